@@ -809,19 +809,19 @@ int gen_field_fetch_ds (struct arg *arg, int *vars, int num, int empty) {
       assert (0);
     } else {
       assert (t == NAME_VAR_NUM);
-      printf ("%sassert (in_remaining (in) >= 4);\n", offset);
+      printf ("%sif (in_remaining (in) < 4) { return 0; }\n", offset);
       if (arg->id && strlen (arg->id)) {
-        printf ("%sresult->%s = (decltype(result->%s))malloc (4);", offset, arg->id, arg->id);
+        printf ("%sresult->%s = (decltype(result->%s))tl_ds_malloc (in, 4);", offset, arg->id, arg->id);
         printf ("%s*result->%s = prefetch_i32 (in);", offset, arg->id);
       } else {
-        printf ("%sresult->f%d = (decltype(result->f%d))malloc (4);", offset, num - 1, num - 1);
+        printf ("%sresult->f%d = (decltype(result->f%d))tl_ds_malloc (in, 4);", offset, num - 1, num - 1);
         printf ("%s*result->f%d = prefetch_i32 (in);", offset, num - 1);
       }
       if (vars[arg->var_num] == 0) {
         printf ("%sstruct paramed_type *var%d = INT2PTR (fetch_i32 (in));\n", offset, arg->var_num);
         vars[arg->var_num] = 2;
       } else if (vars[arg->var_num] == 2) {
-        printf ("%sassert (vars%d == INT2PTR (fetch_i32 (in)));\n", offset, arg->var_num);
+        printf ("%sif (var%d != INT2PTR (fetch_i32 (in))) { return 0; }\n", offset, arg->var_num);
       } else {
         assert (0);
         return -1;
@@ -856,6 +856,11 @@ int gen_field_fetch_ds (struct arg *arg, int *vars, int num, int empty) {
       } else {
         printf ("fetch_ds_type_bare_%s (in, &field%d);\n", t == NODE_TYPE_VAR_TYPE ? "any" : ((struct tl_tree_type *)arg->type)->type->print_id, num);
       }
+      if (arg->id && strlen (arg->id)) {
+        printf ("%sif (!result->%s) { return 0; }\n", offset, arg->id);
+      } else {
+        printf ("%sif (!result->f%d) { return 0; }\n", offset, num - 1);
+      }
     } else {
       assert (t == NODE_TYPE_ARRAY);
       printf ("%sint multiplicity%d = PTR2INT (\n", offset, num);
@@ -863,6 +868,7 @@ int gen_field_fetch_ds (struct arg *arg, int *vars, int num, int empty) {
       (void)result;
       assert(result >= 0);
       printf ("%s);\n", offset);
+      printf ("%sif (multiplicity%d < 0 || multiplicity%d > in_remaining (in)) { return 0; }\n", offset, num, num);
       printf ("%sconst struct paramed_type &field%d = \n", offset, num);
       result = gen_create (((struct tl_tree_array *)arg->type)->args[0]->type, vars, 2 + o);
       assert(result >= 0);
@@ -872,16 +878,16 @@ int gen_field_fetch_ds (struct arg *arg, int *vars, int num, int empty) {
       } else {
         printf ("%sresult->f%d = (decltype(result->f%d))", offset, num - 1, num - 1);
       }
-      printf ("calloc (1, multiplicity%d * sizeof (void *));\n", num);
+      printf ("tl_ds_calloc (in, multiplicity%d * sizeof (void *));\n", num);
       printf ("%s{\n", offset);
       printf ("%s  int i = 0;\n", offset);
       printf ("%s  while (i < multiplicity%d) {\n", offset, num);
       if (arg->id && strlen (arg->id)) {
-        printf ("%s    result->%s[i ++] =", offset, arg->id);
+        printf ("%s    if (!(result->%s[i ++] = ", offset, arg->id);
       } else {
-        printf ("%s    result->f%d[i ++] = ", offset, num - 1);
+        printf ("%s    if (!(result->f%d[i ++] = ", offset, num - 1);
       }
-      printf ("fetch_ds_type_%s (in, &field%d);\n", "any", num);
+      printf ("fetch_ds_type_%s (in, &field%d))) { return 0; }\n", "any", num);
       printf ("%s  }\n", offset);
       printf ("%s}\n", offset);
     }
@@ -1387,7 +1393,7 @@ void gen_constructor_fetch_ds (struct tl_combinator *c) {
 
   printf ("  ");
   print_c_type_name (c->result, "  ", 0);
-  printf ("  result = (decltype(result))calloc (1, sizeof (*result));\n");
+  printf ("  result = (decltype(result))tl_ds_calloc (in, sizeof (*result));\n");
 
   struct tl_type *T = ((struct tl_tree_type *)c->result)->type;
   if (T->constructors_num > 1) {
@@ -1395,30 +1401,27 @@ void gen_constructor_fetch_ds (struct tl_combinator *c) {
   }
 
   if (c->name == NAME_INT) {
-    printf ("  assert (in_remaining (in) >= 4);\n");
+    printf ("  if (in_remaining (in) < 4) { return 0; }\n");
     printf ("  *result = fetch_i32 (in);\n");
     printf ("  return result;\n");
     printf ("}\n");
     return;
   } else if (c->name == NAME_LONG) {
-    printf ("  assert (in_remaining (in) >= 8);\n");
+    printf ("  if (in_remaining (in) < 8) { return 0; }\n");
     printf ("  *result = fetch_i64 (in);\n");
     printf ("  return result;\n");
     printf ("}\n");
     return;
   } else if (c->name == NAME_STRING || c->name == NAME_BYTES) {
-    printf ("  assert (in_remaining (in) >= 4);\n");
     printf ("  ssize_t l = prefetch_strlen (in);\n");
-    printf ("  assert (l >= 0);\n");
+    printf ("  if (l < 0) { return 0; }\n");
     printf ("  result->len = l;\n");
-    printf ("  result->data = (decltype(result->data))malloc (l + 1);\n");
-    printf ("  result->data[l] = 0;\n");
-    printf ("  memcpy (result->data, fetch_str (in, l), l);\n");
+    printf ("  result->data = fetch_ds_str (in, l);\n");
     printf ("  return result;\n");
     printf ("}\n");
     return;
   } else if (c->name == NAME_DOUBLE) {
-    printf ("  assert (in_remaining (in) >= 8);\n");
+    printf ("  if (in_remaining (in) < 8) { return 0; }\n");
     printf ("  *result = fetch_double (in);\n");
     printf ("  return result;\n");
     printf ("}\n");
@@ -1546,17 +1549,85 @@ void gen_constructor_store_ds (struct tl_combinator *c) {
   printf ("}\n"); 
 }
 
+/* Polymorphic types with at least this many constructors find the constructor for a
+   magic with a perfect hash table built here instead of a switch. */
+#define DISPATCH_TABLE_MIN_CONSTRUCTORS 8
+
+static unsigned dispatch_slot (unsigned magic, unsigned mult, int bits) {
+  return (unsigned)(magic * mult) >> (32 - bits);
+}
+
+unsigned find_dispatch_hash (struct tl_type *t, int *bits) {
+  int b = 1;
+  while ((1 << b) < 2 * t->constructors_num) { b ++; }
+  for (; b <= 16; b ++) {
+    char *used = malloc0 (1 << b);
+    unsigned seed = 0x9e3779b9;
+    int k;
+    for (k = 0; k < 100000; k ++) {
+      unsigned mult = seed | 1;
+      seed = seed * 1664525 + 1013904223;
+      memset (used, 0, 1 << b);
+      int i;
+      for (i = 0; i < t->constructors_num; i++) {
+        unsigned slot = dispatch_slot (t->constructors[i]->name, mult, b);
+        if (used[slot]) { break; }
+        used[slot] = 1;
+      }
+      if (i == t->constructors_num) {
+        free (used);
+        *bits = b;
+        return mult;
+      }
+    }
+    free (used);
+  }
+  assert (0);
+  return 0;
+}
+
+void gen_dispatch_table (struct tl_type *t, const char *what, const char *fail) {
+  int bits;
+  unsigned mult = find_dispatch_hash (t, &bits);
+  int size = 1 << bits;
+  int *slots = malloc0 (size * sizeof (int));
+  int i;
+  for (i = 0; i < size; i++) {
+    slots[i] = -1;
+  }
+  for (i = 0; i < t->constructors_num; i++) {
+    slots[dispatch_slot (t->constructors[i]->name, mult, bits)] = i;
+  }
+  printf ("  static constexpr tl_dispatch_entry<decltype(&%s_constructor_%s)> table[%d] = {\n", what, t->constructors[0]->print_id, size);
+  for (i = 0; i < size; i++) {
+    if (slots[i] >= 0) {
+      printf ("    { 0x%08x, %s_constructor_%s },\n", t->constructors[slots[i]]->name, what, t->constructors[slots[i]]->print_id);
+    } else {
+      printf ("    { 0, nullptr },\n");
+    }
+  }
+  printf ("  };\n");
+  printf ("  const auto &entry = table[TL_DISPATCH_SLOT (magic, 0x%08xu, %d)];\n", mult, bits);
+  printf ("  if (entry.magic != magic || !entry.handler) { %s }\n", fail);
+  printf ("  return entry.handler (in, T);\n");
+  free (slots);
+}
+
 void gen_type_skip (struct tl_type *t) {
   printf ("int skip_type_%s (struct tgl_in_buffer *in, const struct paramed_type *T) {\n", t->print_id);
   printf ("  if (in_remaining (in) < 4) { return -1;}\n");
   printf ("  uint32_t magic = fetch_i32 (in);\n");
-  printf ("  switch (magic) {\n");
   int i;
-  for (i = 0; i < t->constructors_num; i++) {
-     printf ("  case 0x%08x: return skip_constructor_%s (in, T);\n", t->constructors[i]->name, t->constructors[i]->print_id);
+  if (t->constructors_num >= DISPATCH_TABLE_MIN_CONSTRUCTORS) {
+    gen_dispatch_table (t, "skip", "return -1;");
+  } else {
+    printf ("  switch (magic) {\n");
+    for (i = 0; i < t->constructors_num; i++) {
+       printf ("  case 0x%08x: return skip_constructor_%s (in, T);\n", t->constructors[i]->name, t->constructors[i]->print_id);
+    }
+    printf ("  default: return -1;\n");
+    printf ("  }\n");
   }
-  printf ("  default: return -1;\n");
-  printf ("  }\n");
   printf ("}\n");
   printf ("int skip_type_bare_%s (struct tgl_in_buffer *in, const struct paramed_type *T) {\n", t->print_id);
   if (t->constructors_num > 1) {
@@ -1708,15 +1779,19 @@ void gen_type_fetch_ds (struct tl_type *t) {
   print_c_type_name (t->constructors[0]->result, "", 0);
 
   printf ("fetch_ds_type_%s (struct tgl_in_buffer *in, const struct paramed_type *T) {\n", t->print_id);
-  printf ("  assert (in_remaining (in) >= 4);\n");
+  printf ("  if (in_remaining (in) < 4) { return 0; }\n");
   printf ("  uint32_t magic = fetch_i32 (in);\n");
-  printf ("  switch (magic) {\n");
   int i;
-  for (i = 0; i < t->constructors_num; i++) {
-     printf ("  case 0x%08x: return fetch_ds_constructor_%s (in, T); break;\n", t->constructors[i]->name, t->constructors[i]->print_id);
+  if (t->constructors_num >= DISPATCH_TABLE_MIN_CONSTRUCTORS) {
+    gen_dispatch_table (t, "fetch_ds", "return 0;");
+  } else {
+    printf ("  switch (magic) {\n");
+    for (i = 0; i < t->constructors_num; i++) {
+       printf ("  case 0x%08x: return fetch_ds_constructor_%s (in, T); break;\n", t->constructors[i]->name, t->constructors[i]->print_id);
+    }
+    printf ("  default: return NULL;\n");
+    printf ("  }\n");
   }
-  printf ("  default: assert (0); return NULL;\n");
-  printf ("  }\n");
   printf ("}\n");
   print_c_type_name (t->constructors[0]->result, "", 0);
   printf ("fetch_ds_type_bare_%s (struct tgl_in_buffer *in, const struct paramed_type *T) {\n", t->print_id);
@@ -1729,7 +1804,6 @@ void gen_type_fetch_ds (struct tl_type *t) {
   } else {
     printf ("  return fetch_ds_constructor_%s (in, T);\n", t->constructors[0]->print_id);
   }
-  printf ("  assert (0);\n");
   printf ("  return NULL;\n");
   printf ("}\n");
 }
@@ -25,6 +25,7 @@
 #include <tgl/tgl_net.h>
 #include <tgl/tgl_timer.h>
 
+#include <cassert>
 #include <chrono>
 #include <deque>
 #include <memory>
@@ -47,6 +48,13 @@ public:
         std::memcpy(m_data.data(), data, size);
     }
 
+    tgl_net_buffer(std::vector<char>&& data, size_t offset)
+        : m_data(std::move(data))
+        , m_current_position(offset)
+    {
+        assert(m_data.size() >= m_current_position);
+    }
+
     char* data()
     {
         assert(m_data.size() >= m_current_position);
@@ -74,6 +82,60 @@ private:
     size_t m_current_position;
 };
 
+// A single contiguous buffer for the received data, so any number of unread
+// bytes can be looked at in place. Data is received straight into the free space
+// at its end, and the unread data is moved to the front when that runs out.
+//
+// While the buffer is pinned, memory which has been handed out is never moved
+// or overwritten, so received data can be processed in place even if more data
+// arrives in the middle of it.
+class tgl_net_read_buffer {
+public:
+    tgl_net_read_buffer()
+        : m_begin(0)
+        , m_end(0)
+        , m_pin_count(0)
+    { }
+
+    char* data() { return m_data.data() + m_begin; }
+    size_t size() const { return m_end - m_begin; }
+    bool empty() const { return m_begin == m_end; }
+
+    // Bytes consumed from the front which are still in the buffer.
+    size_t consumed_size() const { return m_begin; }
+
+    void consume(size_t len)
+    {
+        assert(len <= size());
+        m_begin += len;
+        if (m_begin == m_end && !m_pin_count) {
+            m_begin = m_end = 0;
+        }
+    }
+
+    // Returns free space for at least min_size bytes at the end of the buffer.
+    char* reserve(size_t min_size);
+    size_t free_size() const { return m_data.size() - m_end; }
+
+    void commit(size_t len)
+    {
+        assert(len <= free_size());
+        m_end += len;
+    }
+
+    void clear() { consume(size()); }
+
+    void pin() { ++m_pin_count; }
+    void unpin();
+
+private:
+    std::vector<char> m_data;
+    std::vector<std::vector<char>> m_retired_data;
+    size_t m_begin;
+    size_t m_end;
+    int m_pin_count;
+};
+
 class tgl_connection_base : public std::enable_shared_from_this<tgl_connection_base>
         , public tgl_connection, public tgl_online_status_observer
 {
@@ -91,8 +153,11 @@ public:
 
     virtual ssize_t read(void* buffer, size_t len) override;
     virtual ssize_t write(const void* data, size_t len) override;
+    virtual ssize_t write_buffer(std::vector<char>&& data, size_t offset) override;
+    virtual ssize_t writev(std::vector<tgl_write_buffer>&& buffers) override;
     virtual ssize_t peek(void* data, size_t len) override;
-    virtual size_t available_bytes_for_read() override { return m_available_bytes_for_read; }
+    virtual char* read_in_place(size_t len) override;
+    virtual size_t available_bytes_for_read() override { return m_read_buffer.size(); }
     virtual void flush() override;
     virtual tgl_connection_status status() const override { return m_connection_status; }
 
@@ -119,6 +184,12 @@ protected:
     void close_internal(bool);
     void connect_finished(bool success);
     void data_received(const std::shared_ptr<tgl_net_buffer>& buffer);
+
+    // To receive without an intermediate buffer, read into receive_buffer() and
+    // report the number of bytes received with data_received().
+    char* receive_buffer(size_t min_size) { return m_read_buffer.reserve(min_size); }
+    size_t receive_buffer_size() const { return m_read_buffer.free_size(); }
+    void data_received(size_t bytes);
     void lost();
     void error();
 
@@ -128,6 +199,8 @@ protected:
     std::string m_ipv6_address;
     int m_ipv4_port;
     int m_ipv6_port;
+    // Writes only queue buffers here. start_write() is called on flush(), so it can send
+    // everything queued since the previous flush with one vectored write.
     std::deque<std::shared_ptr<tgl_net_buffer>> m_write_buffer_queue;
 
 private:
@@ -162,8 +235,8 @@ private:
     std::chrono::time_point<std::chrono::steady_clock> m_last_restart_time;
     std::chrono::milliseconds m_restart_duration;
 
-    std::deque<std::shared_ptr<tgl_net_buffer>> m_read_buffer_queue;
-    size_t m_available_bytes_for_read;
+    tgl_net_read_buffer m_read_buffer;
+    int m_consume_depth;
     std::weak_ptr<tgl_mtproto_client> m_mtproto_client;
     std::weak_ptr<tgl_online_status_observer> m_this_weak_observer;
 
@@ -0,0 +1,130 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include <tgl/impl/tgl_net_base.h>
+#include <tgl/tgl_net.h>
+#include <tgl/tgl_timer.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A reference backend for Linux: a single threaded epoll event loop with
+// non-blocking TCP connections, and timers driven by one timerfd. Everything,
+// including the calls into tgl from the callbacks, runs on the thread calling
+// run() or run_once().
+class tgl_epoll_loop
+{
+public:
+    using event_handler = std::function<void(uint32_t events)>;
+
+    tgl_epoll_loop();
+    ~tgl_epoll_loop();
+
+    tgl_epoll_loop(const tgl_epoll_loop&) = delete;
+    tgl_epoll_loop& operator=(const tgl_epoll_loop&) = delete;
+
+    // Dispatches events until stop() is called.
+    void run();
+
+    // Waits for events for at most timeout seconds, or until there are any if the
+    // timeout is negative, and dispatches them.
+    void run_once(double timeout);
+
+    void stop() { m_stopped = true; }
+
+    bool add_fd(int fd, uint32_t events, const event_handler& handler);
+    void remove_fd(int fd);
+
+    // Calls the callback once the monotonic clock reaches the deadline. Returns an id for cancel().
+    uint64_t schedule(double deadline, const std::function<void()>& callback);
+    void cancel(uint64_t timer_id);
+
+    // The monotonic clock the deadlines refer to, in seconds.
+    static double now();
+
+private:
+    void arm_timer_fd();
+    void run_expired_timers();
+
+    int m_epoll_fd;
+    int m_timer_fd;
+    bool m_stopped;
+    uint64_t m_next_token;
+    std::unordered_map<uint64_t, std::shared_ptr<event_handler>> m_handlers;
+    std::unordered_map<int, uint64_t> m_fd_tokens;
+    std::map<std::pair<double, uint64_t>, std::function<void()>> m_timers;
+    std::unordered_map<uint64_t, double> m_timer_deadlines;
+};
+
+class tgl_epoll_timer_factory : public tgl_timer_factory
+{
+public:
+    explicit tgl_epoll_timer_factory(const std::shared_ptr<tgl_epoll_loop>& loop) : m_loop(loop) { }
+
+    virtual std::shared_ptr<tgl_timer> create_timer(const std::function<void()>& cb) override;
+
+private:
+    std::shared_ptr<tgl_epoll_loop> m_loop;
+};
+
+class tgl_epoll_connection : public tgl_connection_base
+{
+public:
+    tgl_epoll_connection(const std::shared_ptr<tgl_epoll_loop>& loop,
+            const std::vector<std::pair<std::string, int>>& ipv4_options,
+            const std::vector<std::pair<std::string, int>>& ipv6_options,
+            const std::weak_ptr<tgl_mtproto_client>& client);
+    virtual ~tgl_epoll_connection();
+
+protected:
+    virtual bool connect() override;
+    virtual void disconnect() override;
+    virtual void start_read() override;
+    virtual void start_write() override;
+
+private:
+    void handle_events(uint32_t events);
+
+    std::shared_ptr<tgl_epoll_loop> m_loop;
+    int m_fd;
+    bool m_connecting;
+};
+
+class tgl_epoll_connection_factory : public tgl_connection_factory
+{
+public:
+    explicit tgl_epoll_connection_factory(const std::shared_ptr<tgl_epoll_loop>& loop) : m_loop(loop) { }
+
+    virtual std::shared_ptr<tgl_connection> create_connection(
+            const std::vector<std::pair<std::string, int>>& ipv4_options,
+            const std::vector<std::pair<std::string, int>>& ipv6_options,
+            const std::weak_ptr<tgl_mtproto_client>& client) override;
+
+private:
+    std::shared_ptr<tgl_epoll_loop> m_loop;
+};
@@ -0,0 +1,60 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2017
+*/
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+struct tgl_future_salt {
+    int64_t salt = 0;
+    // Server times, in seconds.
+    int32_t valid_since = 0;
+    int32_t valid_until = 0;
+};
+
+// What a DC needs to send its first encrypted message without a key exchange.
+struct tgl_dc_keys {
+    int32_t dc_id = 0;
+    std::array<unsigned char, 256> auth_key {};
+    // The temp key bound to auth_key when PFS is enabled. temp_auth_key_expires is the
+    // server time it expires at, or 0 if there is no such key.
+    std::array<unsigned char, 256> temp_auth_key {};
+    int64_t temp_auth_key_expires = 0;
+    int64_t server_salt = 0;
+    // Salts the server handed out in advance, ordered by valid_since.
+    std::vector<tgl_future_salt> future_salts;
+    // Server time minus local system time, in seconds.
+    double server_time_delta = 0;
+};
+
+class tgl_dc_key_storage {
+public:
+    virtual ~tgl_dc_key_storage() { }
+
+    virtual void store_keys(const tgl_dc_keys& keys) = 0;
+
+    // Returns nullptr if nothing is stored for the DC.
+    virtual std::shared_ptr<tgl_dc_keys> load_keys(int32_t dc_id) = 0;
+
+    virtual void remove_keys(int32_t dc_id) = 0;
+};
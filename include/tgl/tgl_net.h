@@ -33,14 +33,44 @@ struct tgl_net_stats
     uint64_t bytes_received;
 };
 
+// An owned buffer to be written from offset on.
+struct tgl_write_buffer
+{
+    std::vector<char> data;
+    size_t offset;
+};
+
 class tgl_connection {
 public:
     virtual void open() = 0;
     virtual void close() = 0;
+    // Writes may only be queued: nothing is guaranteed to be sent before the next flush().
     virtual ssize_t write(const void* data, size_t len) = 0;
+    // Writes the data from offset on, taking over the buffer instead of copying it if possible.
+    virtual ssize_t write_buffer(std::vector<char>&& data, size_t offset)
+    {
+        return write(data.data() + offset, data.size() - offset);
+    }
+    // Writes all buffers in order, as one batch if possible.
+    virtual ssize_t writev(std::vector<tgl_write_buffer>&& buffers)
+    {
+        ssize_t written = 0;
+        for (auto& buffer: buffers) {
+            written += write_buffer(std::move(buffer.data), buffer.offset);
+        }
+        return written;
+    }
     virtual ssize_t read(void* data, size_t len) = 0;
     virtual ssize_t peek(void* data, size_t len) = 0;
+    // Consumes the next len bytes and returns them in place if they can be handed out without
+    // copying them to a new buffer. The bytes may start up to 3 bytes past a 4 byte boundary,
+    // in which case the bytes from that boundary on may be written over, so the data can be
+    // moved into alignment while it's processed. The memory stays valid until the next call.
+    // Returns nullptr, consuming nothing, otherwise.
+    virtual char* read_in_place(size_t len) { return nullptr; }
     virtual size_t available_bytes_for_read() = 0;
+    // Sends everything written since the previous flush, at once if possible. Every write has
+    // to be followed by a flush at some point.
     virtual void flush() = 0;
     virtual tgl_connection_status status() const = 0;
 
@@ -113,6 +113,25 @@ enum class tgl_upload_option
     auto_detect_document_type, // implies as_document
 };
 
+// Where the parts of an upload are read from instead of a tgl_read_callback. The parts
+// are read straight into the queries which send them, in any order.
+class tgl_upload_source
+{
+public:
+    virtual ~tgl_upload_source() { }
+
+    // Reads length bytes at offset into buffer. Returns the number of bytes read, which is
+    // only less than length at the end of the file, or -1 on error.
+    virtual int64_t read(uint64_t offset, char* buffer, size_t length) = 0;
+
+    // Reads with pread() from the file at path, which is opened right away. Returns nullptr
+    // if it can't be opened.
+    static std::shared_ptr<tgl_upload_source> from_file(const std::string& path);
+
+    // Reads with pread() from fd, which has to stay open until the upload is done.
+    static std::shared_ptr<tgl_upload_source> from_descriptor(int fd);
+};
+
 struct tgl_upload_document
 {
     tgl_document_type type = tgl_document_type::unknown;
@@ -126,6 +145,8 @@ struct tgl_upload_document
     std::string file_name;
     std::string caption;
     std::vector<uint8_t> thumb_data;
+    // If set, the file is read from here and the read callback isn't used.
+    std::shared_ptr<tgl_upload_source> source;
 };
 
 struct tgl_download_document
@@ -197,4 +218,11 @@ public:
     virtual bool is_uploading_file(int64_t message_id) const = 0;
 
     virtual bool is_downloading_file(int64_t download_id) const = 0;
+
+    // Limits the bytes of file parts in flight for a single transfer and for all transfers
+    // together. Within these limits each transfer's window follows the measured throughput
+    // and round trip time. The per transfer limit applies to transfers started afterwards,
+    // the total one right away, to the running transfers as well. Does nothing unless
+    // overridden.
+    virtual void set_max_bytes_in_flight(size_t per_transfer, size_t total) { }
 };
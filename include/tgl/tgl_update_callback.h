@@ -102,5 +102,7 @@ public:
     virtual void dc_updated(const tgl_dc* dc) = 0;
     virtual void active_dc_changed(int32_t new_dc_id) = 0;
     virtual void connection_status_changed(tgl_connection_status status) = 0;
+    // Called when another of the DCs given to tgl_user_agent::set_warm_up_dcs() is ready to be used.
+    virtual void dc_warm_up_progress(size_t ready_dc_count, size_t total_dc_count) { }
     virtual ~tgl_update_callback() { }
 };
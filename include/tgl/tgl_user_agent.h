@@ -28,8 +28,10 @@
 #include "tgl_secret_chat.h"
 
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 class tgl_connection_factory;
 class tgl_dc;
@@ -37,6 +39,7 @@ class tgl_secret_chat;
 class tgl_transfer_manager;
 class tgl_timer_factory;
 class tgl_unconfirmed_secret_message_storage;
+class tgl_dc_key_storage;
 class tgl_update_callback;
 
 class tgl_user_agent: public tgl_query_api
@@ -72,6 +75,24 @@ public:
 
     virtual void set_pfs_enabled(bool) = 0;
     virtual void set_ipv6_enabled(bool) = 0;
+    // Coalesces the small messages sent to a DC within window_seconds into one msg_container.
+    // A window of 0 coalesces the messages sent within the same event loop iteration.
+    virtual void set_message_batching_enabled(bool enabled, double window_seconds = 0) = 0;
+    // File transfers to a DC go over a separate media session with up to max_connections connections
+    // of its own, so they don't hold up anything else sent to that DC; with max_connections 0 they
+    // share the main session. min_connections of them are opened with the first transfer and kept
+    // open; any further media connection is closed after idle_timeout_seconds without traffic.
+    virtual void set_secondary_connection_limits(size_t min_connections, size_t max_connections, double idle_timeout_seconds) = 0;
+    // Encrypts and decrypts file transfers on thread_count threads of their own. post_to_loop may be
+    // called from any of them and has to run the function it is given on the thread the library's
+    // timers fire on. By default, and with 0 threads, that work is done on the library's thread.
+    // Takes effect before the first encrypted transfer.
+    virtual void set_transfer_crypto_threads(size_t thread_count,
+            const std::function<void(const std::function<void()>&)>& post_to_loop) = 0;
+    // Once signed in, connects to these DCs, creates their keys and transfers the authorization to
+    // them all at once instead of when the first query for each of them comes, and keeps them
+    // connected. tgl_update_callback::dc_warm_up_progress() reports how many of them are ready.
+    virtual void set_warm_up_dcs(const std::vector<int32_t>& dc_ids) = 0;
 
     virtual void reset_authorization() = 0;
     virtual void add_rsa_key(const std::string& key) = 0;
@@ -90,9 +111,14 @@ public:
 
     virtual void set_callback(const std::shared_ptr<tgl_update_callback>& cb) = 0;
     virtual void set_connection_factory(const std::shared_ptr<tgl_connection_factory>& factory) = 0;
+    // The library runs all of its timers off one timer of this factory. They fire at a resolution
+    // of 10 ms, except the ones started with a delay of 0, which fire as soon as that timer does.
     virtual void set_timer_factory(const std::shared_ptr<tgl_timer_factory>& factory) = 0;
     virtual tgl_transfer_manager* transfer_manager() const = 0;
     virtual void set_unconfirmed_secret_message_storage(const std::shared_ptr<tgl_unconfirmed_secret_message_storage>& storage) = 0;
+    // Keys, salts and time deltas of the DCs are saved to and restored from this storage,
+    // so that a restart can skip the key exchange with every DC.
+    virtual void set_dc_key_storage(const std::shared_ptr<tgl_dc_key_storage>& storage) = 0;
 
     virtual int32_t create_secret_chat_id() const = 0;
 
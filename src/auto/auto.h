@@ -53,6 +53,16 @@ struct paramed_type {
 #define INT2PTR(x) (struct paramed_type *)(intptr_t)(((intptr_t)x) * 2 + 1)
 #define PTR2INT(x) ((((intptr_t)x) - 1) / 2)
 
+/* Entry of the perfect hash tables the generator emits for dispatching on the
+   constructor magic of types with many constructors. */
+template<typename F>
+struct tl_dispatch_entry {
+  uint32_t magic;
+  F handler;
+};
+
+#define TL_DISPATCH_SLOT(magic, mult, bits) ((uint32_t)((uint32_t)(magic) * (uint32_t)(mult)) >> (32 - (bits)))
+
 static inline void *memdup (const void *d, int len) {
   assert (d || !len);
   if (!d) { return 0; }
@@ -0,0 +1,334 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "crypto/crypto_aes_ige.h"
+
+#include <algorithm>
+#include <limits>
+#include <string.h>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TGL_AES_NI 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define TGL_AES_NI_TARGET __attribute__((target("aes,sse2")))
+#endif
+
+namespace tgl {
+namespace impl {
+
+static constexpr int AES_256_ROUNDS = 14;
+
+#ifdef TGL_AES_NI
+TGL_AES_NI_TARGET static inline __m128i aes_256_expand_even(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, assist);
+}
+
+TGL_AES_NI_TARGET static inline __m128i aes_256_expand_odd(__m128i key, __m128i even)
+{
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0), 0xaa);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, assist);
+}
+
+TGL_AES_NI_TARGET static void aes_ni_expand_key(const unsigned char* key, __m128i* round_keys, bool encrypt)
+{
+    __m128i k[AES_256_ROUNDS + 1];
+    k[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+    k[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 16));
+    // _mm_aeskeygenassist_si128 takes the round constant as an immediate.
+#define TGL_AES_256_EXPAND(i, rcon) \
+    k[i] = aes_256_expand_even(k[i - 2], _mm_aeskeygenassist_si128(k[i - 1], rcon)); \
+    k[i + 1] = aes_256_expand_odd(k[i - 1], k[i]);
+    TGL_AES_256_EXPAND(2, 0x01)
+    TGL_AES_256_EXPAND(4, 0x02)
+    TGL_AES_256_EXPAND(6, 0x04)
+    TGL_AES_256_EXPAND(8, 0x08)
+    TGL_AES_256_EXPAND(10, 0x10)
+    TGL_AES_256_EXPAND(12, 0x20)
+    k[14] = aes_256_expand_even(k[12], _mm_aeskeygenassist_si128(k[13], 0x40));
+#undef TGL_AES_256_EXPAND
+
+    if (encrypt) {
+        for (int i = 0; i <= AES_256_ROUNDS; ++i) {
+            round_keys[i] = k[i];
+        }
+    } else {
+        round_keys[0] = k[AES_256_ROUNDS];
+        for (int i = 1; i < AES_256_ROUNDS; ++i) {
+            round_keys[i] = _mm_aesimc_si128(k[AES_256_ROUNDS - i]);
+        }
+        round_keys[AES_256_ROUNDS] = k[0];
+    }
+    memset(k, 0, sizeof(k));
+}
+
+TGL_AES_NI_TARGET static void aes_ni_ige_encrypt(const __m128i* round_keys,
+        const unsigned char* in, unsigned char* out, size_t length, unsigned char iv[32])
+{
+    __m128i iv1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+    __m128i iv2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv + 16));
+    for (size_t offset = 0; offset < length; offset += 16) {
+        __m128i plain = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + offset));
+        __m128i block = _mm_xor_si128(_mm_xor_si128(plain, iv1), round_keys[0]);
+        for (int i = 1; i < AES_256_ROUNDS; ++i) {
+            block = _mm_aesenc_si128(block, round_keys[i]);
+        }
+        block = _mm_xor_si128(_mm_aesenclast_si128(block, round_keys[AES_256_ROUNDS]), iv2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + offset), block);
+        iv1 = block;
+        iv2 = plain;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv), iv1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv + 16), iv2);
+}
+
+TGL_AES_NI_TARGET static void aes_ni_ige_decrypt(const __m128i* round_keys,
+        const unsigned char* in, unsigned char* out, size_t length, unsigned char iv[32])
+{
+    __m128i iv1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+    __m128i iv2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv + 16));
+    for (size_t offset = 0; offset < length; offset += 16) {
+        __m128i cipher = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + offset));
+        __m128i block = _mm_xor_si128(_mm_xor_si128(cipher, iv2), round_keys[0]);
+        for (int i = 1; i < AES_256_ROUNDS; ++i) {
+            block = _mm_aesdec_si128(block, round_keys[i]);
+        }
+        block = _mm_xor_si128(_mm_aesdeclast_si128(block, round_keys[AES_256_ROUNDS]), iv1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + offset), block);
+        iv1 = cipher;
+        iv2 = block;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv), iv1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv + 16), iv2);
+}
+
+namespace {
+struct aes_ni_stream {
+    const aes_ige_job* job;
+    const __m128i* round_keys;
+};
+
+struct aes_ni_lane {
+    const aes_ige_job* job;
+    const __m128i* round_keys;
+    size_t offset;
+    __m128i iv1;
+    __m128i iv2;
+};
+}
+
+// Runs length bytes of N lanes. With N fixed the lanes stay in registers and the
+// independent AES rounds of the lanes overlap in the pipeline.
+template<bool ENCRYPT, size_t N>
+TGL_AES_NI_TARGET static void aes_ni_ige_lanes(aes_ni_lane* lanes, size_t length)
+{
+    unsigned char* data[N];
+    const __m128i* round_keys[N];
+    __m128i iv1[N];
+    __m128i iv2[N];
+    for (size_t l = 0; l < N; ++l) {
+        data[l] = lanes[l].job->data + lanes[l].offset;
+        round_keys[l] = lanes[l].round_keys;
+        iv1[l] = lanes[l].iv1;
+        iv2[l] = lanes[l].iv2;
+    }
+
+    for (size_t offset = 0; offset < length; offset += 16) {
+        __m128i input[N];
+        __m128i block[N];
+        for (size_t l = 0; l < N; ++l) {
+            input[l] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data[l] + offset));
+            block[l] = _mm_xor_si128(_mm_xor_si128(input[l], ENCRYPT ? iv1[l] : iv2[l]), round_keys[l][0]);
+        }
+#pragma GCC unroll 16
+        for (int i = 1; i < AES_256_ROUNDS; ++i) {
+#pragma GCC unroll 4
+            for (size_t l = 0; l < N; ++l) {
+                block[l] = ENCRYPT ? _mm_aesenc_si128(block[l], round_keys[l][i])
+                        : _mm_aesdec_si128(block[l], round_keys[l][i]);
+            }
+        }
+        for (size_t l = 0; l < N; ++l) {
+            if (ENCRYPT) {
+                block[l] = _mm_xor_si128(_mm_aesenclast_si128(block[l], round_keys[l][AES_256_ROUNDS]), iv2[l]);
+                iv1[l] = block[l];
+                iv2[l] = input[l];
+            } else {
+                block[l] = _mm_xor_si128(_mm_aesdeclast_si128(block[l], round_keys[l][AES_256_ROUNDS]), iv1[l]);
+                iv1[l] = input[l];
+                iv2[l] = block[l];
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(data[l] + offset), block[l]);
+        }
+    }
+
+    for (size_t l = 0; l < N; ++l) {
+        lanes[l].iv1 = iv1[l];
+        lanes[l].iv2 = iv2[l];
+    }
+}
+
+template<bool ENCRYPT>
+TGL_AES_NI_TARGET static void aes_ni_ige_interleaved(const std::vector<aes_ni_stream>& streams)
+{
+    aes_ni_lane lanes[aes_ige_key::MAX_INTERLEAVED_STREAMS];
+    size_t lane_count = 0;
+    size_t next_stream = 0;
+
+    while (true) {
+        while (lane_count < aes_ige_key::MAX_INTERLEAVED_STREAMS && next_stream < streams.size()) {
+            aes_ni_lane& lane = lanes[lane_count++];
+            lane.job = streams[next_stream].job;
+            lane.round_keys = streams[next_stream].round_keys;
+            ++next_stream;
+            lane.offset = 0;
+            lane.iv1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lane.job->iv));
+            lane.iv2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lane.job->iv + 16));
+        }
+        if (!lane_count) {
+            break;
+        }
+
+        size_t step_length = std::numeric_limits<size_t>::max();
+        for (size_t l = 0; l < lane_count; ++l) {
+            step_length = std::min(step_length, lanes[l].job->length - lanes[l].offset);
+        }
+
+        switch (lane_count) {
+        case 1: aes_ni_ige_lanes<ENCRYPT, 1>(lanes, step_length); break;
+        case 2: aes_ni_ige_lanes<ENCRYPT, 2>(lanes, step_length); break;
+        case 3: aes_ni_ige_lanes<ENCRYPT, 3>(lanes, step_length); break;
+        default: aes_ni_ige_lanes<ENCRYPT, 4>(lanes, step_length); break;
+        }
+
+        for (size_t l = 0; l < lane_count;) {
+            aes_ni_lane& lane = lanes[l];
+            lane.offset += step_length;
+            if (lane.offset < lane.job->length) {
+                ++l;
+                continue;
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lane.job->iv), lane.iv1);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lane.job->iv + 16), lane.iv2);
+            lane = lanes[--lane_count];
+        }
+    }
+}
+#endif
+
+bool aes_ige_key::hardware_accelerated()
+{
+#ifdef TGL_AES_NI
+    static const bool supported = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void aes_ige_key::set_encrypt_key(const unsigned char key[32])
+{
+    m_encrypt = true;
+    m_hardware = hardware_accelerated();
+#ifdef TGL_AES_NI
+    if (m_hardware) {
+        aes_ni_expand_key(key, reinterpret_cast<__m128i*>(m_round_keys), true);
+        return;
+    }
+#endif
+    TGLC_aes_set_encrypt_key(key, 256, &m_fallback_key);
+}
+
+void aes_ige_key::set_decrypt_key(const unsigned char key[32])
+{
+    m_encrypt = false;
+    m_hardware = hardware_accelerated();
+#ifdef TGL_AES_NI
+    if (m_hardware) {
+        aes_ni_expand_key(key, reinterpret_cast<__m128i*>(m_round_keys), false);
+        return;
+    }
+#endif
+    TGLC_aes_set_decrypt_key(key, 256, &m_fallback_key);
+}
+
+void aes_ige_key::process(const unsigned char* in, unsigned char* out, size_t length, unsigned char iv[32]) const
+{
+    assert(!(length & 15));
+#ifdef TGL_AES_NI
+    if (m_hardware) {
+        const __m128i* round_keys = reinterpret_cast<const __m128i*>(m_round_keys);
+        if (m_encrypt) {
+            aes_ni_ige_encrypt(round_keys, in, out, length, iv);
+        } else {
+            aes_ni_ige_decrypt(round_keys, in, out, length, iv);
+        }
+        return;
+    }
+#endif
+    // OpenSSL reads back blocks it has already written over when the buffers overlap, unless
+    // they are the same.
+    if (out < in && out + length > in) {
+        unsigned char* data = const_cast<unsigned char*>(in);
+        TGLC_aes_ige_encrypt(data, data, length, &m_fallback_key, iv, m_encrypt ? 1 : 0);
+        memmove(out, data, length);
+        return;
+    }
+    TGLC_aes_ige_encrypt(in, out, length, &m_fallback_key, iv, m_encrypt ? 1 : 0);
+}
+
+void aes_ige_key::process_interleaved(const aes_ige_job* jobs, size_t count)
+{
+#ifdef TGL_AES_NI
+    if (hardware_accelerated()) {
+        std::vector<aes_ni_stream> encrypt_streams;
+        std::vector<aes_ni_stream> decrypt_streams;
+        for (size_t i = 0; i < count; ++i) {
+            const aes_ige_key* key = jobs[i].key;
+            assert(key->m_hardware);
+            assert(!(jobs[i].length & 15));
+            aes_ni_stream stream = { &jobs[i], reinterpret_cast<const __m128i*>(key->m_round_keys) };
+            (key->m_encrypt ? encrypt_streams : decrypt_streams).push_back(stream);
+        }
+        aes_ni_ige_interleaved<true>(encrypt_streams);
+        aes_ni_ige_interleaved<false>(decrypt_streams);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        jobs[i].key->process(jobs[i].data, jobs[i].data, jobs[i].length, jobs[i].iv);
+    }
+}
+
+void aes_ige_key::clear()
+{
+    memset(m_round_keys, 0, sizeof(m_round_keys));
+    memset(&m_fallback_key, 0, sizeof(m_fallback_key));
+}
+
+}
+}
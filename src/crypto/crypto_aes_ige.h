@@ -0,0 +1,78 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include "crypto/crypto_aes.h"
+
+#include <cstddef>
+
+namespace tgl {
+namespace impl {
+
+class aes_ige_key;
+
+// One IGE stream for aes_ige_key::process_interleaved(), processed in place.
+struct aes_ige_job {
+    const aes_ige_key* key;
+    unsigned char* data;
+    size_t length;
+    unsigned char* iv;
+};
+
+// AES-256 in IGE mode with the key schedule expanded once. Uses AES-NI when the CPU
+// supports it and falls back to OpenSSL otherwise. A key is for one direction only.
+class aes_ige_key {
+public:
+    aes_ige_key() : m_encrypt(true), m_hardware(false) { }
+    ~aes_ige_key() { clear(); }
+
+    aes_ige_key(const aes_ige_key&) = delete;
+    aes_ige_key& operator=(const aes_ige_key&) = delete;
+
+    void set_encrypt_key(const unsigned char key[32]);
+    void set_decrypt_key(const unsigned char key[32]);
+
+    // Encrypts or decrypts, depending on the key, length bytes which must be a multiple of 16.
+    // in and out may be the same buffer, or out may start before in in the same buffer. iv is
+    // 32 bytes as for OpenSSL's AES_ige_encrypt and is updated so that a longer stream can be
+    // processed in pieces.
+    void process(const unsigned char* in, unsigned char* out, size_t length, unsigned char iv[32]) const;
+
+    void clear();
+
+    // Processes independent streams, running the blocks of up to MAX_INTERLEAVED_STREAMS of
+    // them side by side so that AES-NI works on several blocks at once. IGE is sequential
+    // within a stream, so the jobs must not share an iv.
+    static void process_interleaved(const aes_ige_job* jobs, size_t count);
+
+    static bool hardware_accelerated();
+
+    static constexpr size_t MAX_INTERLEAVED_STREAMS = 4;
+
+private:
+    bool m_encrypt;
+    bool m_hardware;
+    alignas(16) unsigned char m_round_keys[15 * 16];
+    TGLC_aes_key m_fallback_key;
+};
+
+}
+}
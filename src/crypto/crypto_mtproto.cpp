@@ -0,0 +1,151 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "crypto/crypto_mtproto.h"
+
+#include "crypto/crypto_aes_ige.h"
+#include "crypto/crypto_rand.h"
+#include "crypto/crypto_sha.h"
+#include "tgl/tgl_log.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+namespace tgl {
+namespace impl {
+
+// Salt, session id, message id, sequence number and message length.
+static constexpr int MESSAGE_HEADER_SIZE = 32;
+static constexpr int MESSAGE_LENGTH_OFFSET = 28;
+static constexpr int MAX_PADDING_SIZE = 12;
+// Small enough for a decrypted chunk to still be in L1 cache when it is hashed.
+static constexpr int DECRYPT_CHUNK_SIZE = 4096;
+
+static void derive_aes_key(aes_ige_key& aes_key, unsigned char aes_iv[32],
+        const unsigned char* auth_key, const unsigned char msg_key[16], bool encrypt)
+{
+    unsigned char buffer[48];
+    unsigned char sha1_a[20], sha1_b[20], sha1_c[20], sha1_d[20];
+
+    memcpy(buffer, msg_key, 16);
+    memcpy(buffer + 16, auth_key, 32);
+    TGLC_sha1(buffer, 48, sha1_a);
+
+    memcpy(buffer, auth_key + 32, 16);
+    memcpy(buffer + 16, msg_key, 16);
+    memcpy(buffer + 32, auth_key + 48, 16);
+    TGLC_sha1(buffer, 48, sha1_b);
+
+    memcpy(buffer, auth_key + 64, 32);
+    memcpy(buffer + 32, msg_key, 16);
+    TGLC_sha1(buffer, 48, sha1_c);
+
+    memcpy(buffer, msg_key, 16);
+    memcpy(buffer + 16, auth_key + 96, 32);
+    TGLC_sha1(buffer, 48, sha1_d);
+
+    unsigned char aes_key_raw[32];
+    memcpy(aes_key_raw, sha1_a, 8);
+    memcpy(aes_key_raw + 8, sha1_b + 8, 12);
+    memcpy(aes_key_raw + 20, sha1_c + 4, 12);
+
+    memcpy(aes_iv, sha1_a + 8, 12);
+    memcpy(aes_iv + 12, sha1_b, 8);
+    memcpy(aes_iv + 20, sha1_c + 16, 4);
+    memcpy(aes_iv + 24, sha1_d, 8);
+
+    if (encrypt) {
+        aes_key.set_encrypt_key(aes_key_raw);
+    } else {
+        aes_key.set_decrypt_key(aes_key_raw);
+    }
+    memset(aes_key_raw, 0, sizeof(aes_key_raw));
+    memset(buffer, 0, sizeof(buffer));
+}
+
+int TGLC_mtproto_encrypt_message(const unsigned char* auth_key, unsigned char* data,
+        int length, int buffer_size, unsigned char msg_key[16])
+{
+    int padded_length = (length + 15) & -16;
+    assert(length > 0 && padded_length <= buffer_size);
+    if (length <= 0 || padded_length > buffer_size) {
+        return -1;
+    }
+
+    unsigned char sha1_buffer[20];
+    TGLC_sha1(data, length, sha1_buffer);
+    memcpy(msg_key, sha1_buffer + 4, 16);
+
+    if (length < padded_length) {
+        auto result = TGLC_rand_pseudo_bytes(data + length, padded_length - length);
+        TGL_ASSERT_UNUSED(result, result >= 0);
+    }
+
+    aes_ige_key aes_key;
+    unsigned char aes_iv[32];
+    derive_aes_key(aes_key, aes_iv, auth_key, msg_key, true);
+    aes_key.process(data, data, padded_length, aes_iv);
+    return padded_length;
+}
+
+int TGLC_mtproto_decrypt_message(const unsigned char* auth_key, const unsigned char msg_key[16],
+        const unsigned char* in, unsigned char* out, int length)
+{
+    if (length < MESSAGE_HEADER_SIZE || (length & 15)) {
+        return -1;
+    }
+
+    aes_ige_key aes_key;
+    unsigned char aes_iv[32];
+    derive_aes_key(aes_key, aes_iv, auth_key, msg_key, false);
+
+    int chunk_size = std::min(length, DECRYPT_CHUNK_SIZE);
+    aes_key.process(in, out, chunk_size, aes_iv);
+
+    int32_t msg_len;
+    memcpy(&msg_len, out + MESSAGE_LENGTH_OFFSET, 4);
+    if ((msg_len & 3) || msg_len <= 0 || msg_len > length - MESSAGE_HEADER_SIZE
+            || length - MESSAGE_HEADER_SIZE - msg_len > MAX_PADDING_SIZE) {
+        return -1;
+    }
+
+    int hash_length = MESSAGE_HEADER_SIZE + msg_len;
+    TGLC_sha1_ctx sha1_ctx;
+    TGLC_sha1_init(&sha1_ctx);
+    TGLC_sha1_update(&sha1_ctx, out, std::min(chunk_size, hash_length));
+    for (int offset = chunk_size; offset < length; offset += chunk_size) {
+        chunk_size = std::min(length - offset, DECRYPT_CHUNK_SIZE);
+        aes_key.process(in + offset, out + offset, chunk_size, aes_iv);
+        if (offset < hash_length) {
+            TGLC_sha1_update(&sha1_ctx, out + offset, std::min(chunk_size, hash_length - offset));
+        }
+    }
+
+    unsigned char sha1_buffer[20];
+    TGLC_sha1_final(&sha1_ctx, sha1_buffer);
+    if (memcmp(msg_key, sha1_buffer + 4, 16)) {
+        return -1;
+    }
+    return length;
+}
+
+}
+}
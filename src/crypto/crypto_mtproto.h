@@ -0,0 +1,45 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+namespace tgl {
+namespace impl {
+
+// MTProto 1.0 message encryption. data starts at the server salt of an encrypted message,
+// auth_key points into the auth key at the offset for the direction, 0 for messages from
+// the client and 8 for messages from the server, as for tgl_init_aes_auth.
+
+// Computes the message key of the length bytes of plaintext, pads them to a multiple of 16
+// and encrypts them in place. buffer_size is the room available for the padding. Returns
+// the encrypted length.
+int TGLC_mtproto_encrypt_message(const unsigned char* auth_key, unsigned char* data,
+        int length, int buffer_size, unsigned char msg_key[16]);
+
+// Decrypts length bytes from in to out and checks the message length and the message key.
+// out may be in, or start before it in the same buffer, so that the data can be moved into
+// alignment while it is decrypted. The message key is computed while the data is decrypted,
+// a chunk at a time, so that the plaintext is hashed while it is still in cache. Returns
+// length on success and -1 if the message is malformed.
+int TGLC_mtproto_decrypt_message(const unsigned char* auth_key, const unsigned char msg_key[16],
+        const unsigned char* in, unsigned char* out, int length);
+
+}
+}
@@ -32,6 +32,23 @@ inline static void TGLC_sha1(const unsigned char* d, size_t n, unsigned char* md
     SHA1(d, n, md);
 }
 
+typedef SHA_CTX TGLC_sha1_ctx;
+
+inline static void TGLC_sha1_init(TGLC_sha1_ctx* ctx)
+{
+    SHA1_Init(ctx);
+}
+
+inline static void TGLC_sha1_update(TGLC_sha1_ctx* ctx, const unsigned char* d, size_t n)
+{
+    SHA1_Update(ctx, d, n);
+}
+
+inline static void TGLC_sha1_final(TGLC_sha1_ctx* ctx, unsigned char* md)
+{
+    SHA1_Final(md, ctx);
+}
+
 inline static void TGLC_sha256(const unsigned char* d, size_t n, unsigned char* md)
 {
     SHA256(d, n, md);
@@ -0,0 +1,293 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "crypto_work_queue.h"
+
+#include "tgl/tgl_log.h"
+#include "tgl/tgl_timer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <iterator>
+#include <unistd.h>
+
+namespace tgl {
+namespace impl {
+
+std::shared_ptr<output_file> output_file::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return std::shared_ptr<output_file>(new output_file(fd));
+}
+
+output_file::~output_file()
+{
+    close(m_fd);
+}
+
+bool output_file::write(const char* data, size_t length, int64_t offset) const
+{
+    while (length) {
+        ssize_t written = pwrite(m_fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+crypto_work_queue::crypto_work_queue(const std::shared_ptr<tgl_timer_factory>& timer_factory,
+        size_t thread_count, const post_function& post_to_loop)
+    : m_timer_factory(timer_factory)
+    , m_thread_count(post_to_loop ? thread_count : 0)
+    , m_post_to_loop(post_to_loop)
+    , m_thread_jobs(m_thread_count, 0)
+    , m_queued_jobs(m_thread_count)
+    , m_delivery_posted(false)
+    , m_stopping(false)
+{
+}
+
+crypto_work_queue::~crypto_work_queue()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+    for (auto& thread: m_threads) {
+        thread.join();
+    }
+    if (m_inline_timer) {
+        m_inline_timer->cancel();
+    }
+}
+
+void crypto_work_queue::encrypt(const unsigned char key[32], unsigned char iv[32], unsigned char* data, size_t length,
+        const std::function<void(bool)>& done)
+{
+    std::unique_ptr<job> j(new job);
+    j->key.set_encrypt_key(key);
+    j->iv = iv;
+    j->data = data;
+    j->length = length;
+    j->file_offset = 0;
+    j->write_length = 0;
+    j->done = done;
+    add_job(std::move(j));
+}
+
+void crypto_work_queue::decrypt(const unsigned char key[32], unsigned char iv[32], unsigned char* data, size_t length,
+        const std::function<void(bool)>& done)
+{
+    decrypt_and_write(key, iv, data, length, nullptr, 0, 0, done);
+}
+
+void crypto_work_queue::decrypt_and_write(const unsigned char key[32], unsigned char iv[32], unsigned char* data, size_t length,
+        const std::shared_ptr<output_file>& file, int64_t offset, size_t write_length,
+        const std::function<void(bool)>& done)
+{
+    assert(write_length <= length);
+    std::unique_ptr<job> j(new job);
+    j->key.set_decrypt_key(key);
+    j->iv = iv;
+    j->data = data;
+    j->length = length;
+    j->file = file;
+    j->file_offset = offset;
+    j->write_length = write_length;
+    j->done = done;
+    add_job(std::move(j));
+}
+
+void crypto_work_queue::add_job(std::unique_ptr<job>&& j)
+{
+    assert(!(j->length & 15));
+    j->success = true;
+    j->thread_index = 0;
+
+    if (!m_thread_count) {
+        if (!m_inline_timer) {
+            std::weak_ptr<crypto_work_queue> weak_this(shared_from_this());
+            m_inline_timer = m_timer_factory->create_timer([weak_this] {
+                if (auto shared_this = weak_this.lock()) {
+                    shared_this->run_inline_jobs();
+                }
+            });
+        }
+        // The jobs added in the same event loop iteration are interleaved together.
+        m_inline_jobs.push_back(std::move(j));
+        if (m_inline_jobs.size() == 1) {
+            m_inline_timer->start(0);
+        }
+        return;
+    }
+
+    if (m_threads.empty()) {
+        start_threads();
+    }
+
+    // A file's parts share their iv and have to be processed in order, so they stay on one
+    // thread while any of them is queued. A new file goes to the least busy thread.
+    auto it = m_streams.find(j->iv);
+    if (it == m_streams.end()) {
+        size_t thread_index = std::min_element(m_thread_jobs.begin(), m_thread_jobs.end()) - m_thread_jobs.begin();
+        it = m_streams.emplace(j->iv, stream { thread_index, 0 }).first;
+    }
+    it->second.jobs++;
+    j->thread_index = it->second.thread_index;
+    m_thread_jobs[j->thread_index]++;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued_jobs[j->thread_index].push_back(std::move(j));
+    }
+    m_condition.notify_all();
+}
+
+void crypto_work_queue::start_threads()
+{
+    m_weak_this = shared_from_this();
+    TGL_DEBUG("starting " << m_thread_count << " transfer crypto threads");
+    for (size_t i = 0; i < m_thread_count; ++i) {
+        m_threads.emplace_back(&crypto_work_queue::worker_main, this, i);
+    }
+}
+
+void crypto_work_queue::worker_main(size_t thread_index)
+{
+    std::vector<std::unique_ptr<job>> jobs;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this, thread_index] { return m_stopping || !m_queued_jobs[thread_index].empty(); });
+            if (m_stopping) {
+                return;
+            }
+            jobs.swap(m_queued_jobs[thread_index]);
+        }
+
+        run(jobs);
+
+        bool post = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::move(jobs.begin(), jobs.end(), std::back_inserter(m_finished_jobs));
+            post = !m_delivery_posted;
+            m_delivery_posted = true;
+        }
+        jobs.clear();
+
+        if (post) {
+            std::weak_ptr<crypto_work_queue> weak_this = m_weak_this;
+            m_post_to_loop([weak_this] {
+                if (auto shared_this = weak_this.lock()) {
+                    shared_this->deliver_results();
+                }
+            });
+        }
+    }
+}
+
+void crypto_work_queue::run(const std::vector<std::unique_ptr<job>>& jobs)
+{
+    // Each round takes the first remaining job of every stream.
+    std::vector<bool> processed(jobs.size(), false);
+    std::vector<aes_ige_job> round;
+    std::vector<const unsigned char*> round_ivs;
+    size_t remaining = jobs.size();
+    while (remaining) {
+        round.clear();
+        round_ivs.clear();
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (processed[i]) {
+                continue;
+            }
+            bool stream_in_round = std::find(round_ivs.begin(), round_ivs.end(), jobs[i]->iv) != round_ivs.end();
+            round_ivs.push_back(jobs[i]->iv);
+            if (!stream_in_round) {
+                aes_ige_job ige_job = { &jobs[i]->key, jobs[i]->data, jobs[i]->length, jobs[i]->iv };
+                round.push_back(ige_job);
+                processed[i] = true;
+                --remaining;
+            }
+        }
+        aes_ige_key::process_interleaved(round.data(), round.size());
+    }
+
+    for (const auto& j: jobs) {
+        if (j->file && j->write_length) {
+            j->success = j->file->write(reinterpret_cast<const char*>(j->data), j->write_length, j->file_offset);
+        }
+    }
+}
+
+void crypto_work_queue::run_inline_jobs()
+{
+    std::vector<std::unique_ptr<job>> jobs;
+    jobs.swap(m_inline_jobs);
+    run(jobs);
+    finish(jobs);
+}
+
+void crypto_work_queue::deliver_results()
+{
+    std::vector<std::unique_ptr<job>> jobs;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        jobs.swap(m_finished_jobs);
+        m_delivery_posted = false;
+    }
+
+    for (const auto& j: jobs) {
+        assert(m_thread_jobs[j->thread_index]);
+        m_thread_jobs[j->thread_index]--;
+        auto it = m_streams.find(j->iv);
+        assert(it != m_streams.end());
+        if (!--it->second.jobs) {
+            m_streams.erase(it);
+        }
+    }
+
+    finish(jobs);
+}
+
+void crypto_work_queue::finish(const std::vector<std::unique_ptr<job>>& jobs)
+{
+    if (!jobs.empty()) {
+        TGL_DEBUG("finished " << jobs.size() << " transfer crypto jobs");
+    }
+    for (const auto& j: jobs) {
+        j->done(j->success);
+    }
+}
+}
+}
@@ -0,0 +1,137 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include "crypto/crypto_aes_ige.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class tgl_timer;
+class tgl_timer_factory;
+
+namespace tgl {
+namespace impl {
+
+// A file written with positional writes, so that the parts of a download can be written
+// from the crypto worker thread without sharing a file position.
+class output_file
+{
+public:
+    // Creates or truncates the file. Returns nullptr if it can't be opened.
+    static std::shared_ptr<output_file> open(const std::string& path);
+    ~output_file();
+
+    output_file(const output_file&) = delete;
+    output_file& operator=(const output_file&) = delete;
+
+    bool write(const char* data, size_t length, int64_t offset) const;
+
+private:
+    explicit output_file(int fd) : m_fd(fd) { }
+
+    int m_fd;
+};
+
+// Runs the AES-IGE work of file transfers, interleaving the parts of different files.
+// With no threads the jobs run on the library's thread in the next event loop iteration.
+// Otherwise they run on a pool of worker threads; all parts of a file go to the same
+// thread, and post_to_loop, which may be called from any thread, has to run the function
+// it is given on the library's thread to deliver the results. The done callbacks are
+// always called on the library's thread.
+class crypto_work_queue: public std::enable_shared_from_this<crypto_work_queue>
+{
+public:
+    using post_function = std::function<void(const std::function<void()>&)>;
+
+    crypto_work_queue(const std::shared_ptr<tgl_timer_factory>& timer_factory,
+            size_t thread_count, const post_function& post_to_loop);
+    ~crypto_work_queue();
+
+    // The length bytes of data are processed in place. data and iv have to stay valid and
+    // must not be touched until done is called. Jobs with the same iv run in the order they
+    // were added.
+    void encrypt(const unsigned char key[32], unsigned char iv[32], unsigned char* data, size_t length,
+            const std::function<void(bool success)>& done);
+    void decrypt(const unsigned char key[32], unsigned char iv[32], unsigned char* data, size_t length,
+            const std::function<void(bool success)>& done);
+    // Also writes the first write_length bytes of the decrypted data to file at offset. done
+    // gets whether the write succeeded.
+    void decrypt_and_write(const unsigned char key[32], unsigned char iv[32], unsigned char* data, size_t length,
+            const std::shared_ptr<output_file>& file, int64_t offset, size_t write_length,
+            const std::function<void(bool success)>& done);
+
+private:
+    struct job {
+        aes_ige_key key;
+        unsigned char* iv;
+        unsigned char* data;
+        size_t length;
+        std::shared_ptr<output_file> file;
+        int64_t file_offset;
+        size_t write_length;
+        size_t thread_index;
+        bool success;
+        std::function<void(bool success)> done;
+    };
+
+    // The thread a file's parts run on while some of them are queued or running.
+    struct stream {
+        size_t thread_index;
+        size_t jobs;
+    };
+
+    void add_job(std::unique_ptr<job>&& j);
+    void start_threads();
+    void worker_main(size_t thread_index);
+    static void run(const std::vector<std::unique_ptr<job>>& jobs);
+    void run_inline_jobs();
+    void deliver_results();
+    void finish(const std::vector<std::unique_ptr<job>>& jobs);
+
+    std::shared_ptr<tgl_timer_factory> m_timer_factory;
+    size_t m_thread_count;
+    post_function m_post_to_loop;
+
+    // Only used on the library's thread.
+    std::shared_ptr<tgl_timer> m_inline_timer;
+    std::vector<std::unique_ptr<job>> m_inline_jobs;
+    std::unordered_map<const unsigned char*, stream> m_streams;
+    std::vector<size_t> m_thread_jobs;
+
+    std::weak_ptr<crypto_work_queue> m_weak_this;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<std::vector<std::unique_ptr<job>>> m_queued_jobs;
+    std::vector<std::unique_ptr<job>> m_finished_jobs;
+    bool m_delivery_posted;
+    bool m_stopping;
+};
+}
+}
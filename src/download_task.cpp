@@ -40,6 +40,7 @@ download_task::download_task(int64_t id, int32_t size, const tgl_file_location&
     , iv()
     , key()
     , decryption_offset(0)
+    , pending_decryptions(0)
     , valid(true)
     , m_cancel_requested(false)
 {
@@ -56,6 +57,7 @@ download_task::download_task(int64_t id, const std::shared_ptr<tgl_download_docu
     , iv()
     , key()
     , decryption_offset(0)
+    , pending_decryptions(0)
     , valid(true)
     , m_cancel_requested(false)
 {
@@ -23,6 +23,7 @@
 
 #include "tgl/tgl_file_location.h"
 #include "tgl/tgl_transfer_manager.h"
+#include "transfer_window.h"
 
 #include <cstdint>
 #include <cstring>
@@ -36,6 +37,8 @@
 namespace tgl {
 namespace impl {
 
+class output_file;
+
 class download_data {
 public:
     download_data()
@@ -58,6 +61,7 @@ public:
     char* data() const { return m_owning_data ? m_owning_data.get() : m_ref_data; }
     size_t length() const { return m_length; }
     operator bool() const { return !!data() && !!length(); }
+    bool owns_data() const { return !!m_owning_data; }
 
 private:
     char* m_ref_data;
@@ -73,16 +77,21 @@ public:
     int32_t size;
     int32_t type;
     std::unique_ptr<std::ofstream> file_stream;
+    // Encrypted documents are written by the crypto worker thread instead.
+    std::shared_ptr<output_file> output;
     tgl_file_location location;
     std::string file_name;
     std::string ext;
     tgl_download_status status;
     tgl_download_callback callback;
     std::map<size_t, download_data> running_parts;
+    transfer_window window;
     //encrypted documents
     std::vector<unsigned char> iv;
     std::vector<unsigned char> key;
     size_t decryption_offset;
+    // Parts handed to the crypto worker which are not written yet.
+    size_t pending_decryptions;
     bool valid;
     // ---
 
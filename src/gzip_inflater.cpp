@@ -0,0 +1,119 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "gzip_inflater.h"
+
+#include "tgl/tgl_log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+namespace tgl {
+namespace impl {
+
+static constexpr size_t MAX_INFLATED_SIZE = 1 << 24;
+static constexpr size_t MAX_RETAINED_BUFFER_SIZE = 1024 * 1024;
+static constexpr size_t GZIP_HEADER_SIZE = 10;
+static constexpr size_t GZIP_TRAILER_SIZE = 8;
+
+gzip_inflater::gzip_inflater()
+    : m_stream(new z_stream)
+    , m_stream_initialized(false)
+{
+}
+
+gzip_inflater::~gzip_inflater()
+{
+    if (m_stream_initialized) {
+        inflateEnd(m_stream.get());
+    }
+}
+
+bool gzip_inflater::reset_stream()
+{
+    if (m_stream_initialized) {
+        return inflateReset(m_stream.get()) == Z_OK;
+    }
+
+    memset(m_stream.get(), 0, sizeof(z_stream));
+    if (inflateInit2(m_stream.get(), 16 + MAX_WBITS) != Z_OK) {
+        TGL_ERROR("failed to call inflateInit2");
+        return false;
+    }
+    m_stream_initialized = true;
+    return true;
+}
+
+int gzip_inflater::inflate(const void* input, size_t length, std::vector<int32_t>& output)
+{
+    if (length < GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE) {
+        TGL_ERROR("gzip data too short: " << length << " bytes");
+        return -1;
+    }
+
+    if (!reset_stream()) {
+        return -1;
+    }
+
+    // ISIZE is the size of the uncompressed data modulo 2^32, stored little endian
+    // in the last four bytes. It can't be trusted, so the buffer still grows if the
+    // data turns out to be larger.
+    const unsigned char* trailer = static_cast<const unsigned char*>(input) + length - 4;
+    size_t expected_size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (static_cast<uint32_t>(trailer[3]) << 24);
+    size_t capacity = std::max<size_t>(std::min(expected_size, MAX_INFLATED_SIZE), 4);
+    output.resize((capacity + 3) / 4);
+
+    z_stream* stream = m_stream.get();
+    stream->next_in = static_cast<Bytef*>(const_cast<void*>(input));
+    stream->avail_in = length;
+
+    while (true) {
+        stream->next_out = reinterpret_cast<Bytef*>(output.data()) + stream->total_out;
+        stream->avail_out = capacity - stream->total_out;
+        int err = ::inflate(stream, Z_FINISH);
+        if (err == Z_STREAM_END) {
+            break;
+        }
+        if ((err != Z_OK && err != Z_BUF_ERROR) || stream->avail_out || capacity >= MAX_INFLATED_SIZE) {
+            TGL_ERROR("inflate error = " << err << ", inflated " << stream->total_out << " bytes");
+            return -1;
+        }
+        capacity = std::min(capacity * 2, MAX_INFLATED_SIZE);
+        output.resize((capacity + 3) / 4);
+    }
+
+    return stream->total_out;
+}
+
+std::vector<int32_t> gzip_inflater::acquire_buffer()
+{
+    return std::move(m_buffer);
+}
+
+void gzip_inflater::release_buffer(std::vector<int32_t>&& buffer)
+{
+    if (buffer.capacity() * 4 <= MAX_RETAINED_BUFFER_SIZE && buffer.capacity() > m_buffer.capacity()) {
+        m_buffer = std::move(buffer);
+    }
+}
+
+}
+}
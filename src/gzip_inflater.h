@@ -0,0 +1,64 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct z_stream_s;
+
+namespace tgl {
+namespace impl {
+
+// Inflates gzip_packed payloads. The zlib stream is set up once and reset for
+// every payload, and the output buffer is sized from the ISIZE trailer of the
+// gzip stream instead of allocating for the largest possible payload.
+//
+// Output buffers are handed out with acquire_buffer() and given back with
+// release_buffer() once the inflated data has been processed, so processing it
+// may inflate another payload meanwhile.
+class gzip_inflater
+{
+public:
+    gzip_inflater();
+    ~gzip_inflater();
+
+    gzip_inflater(const gzip_inflater&) = delete;
+    gzip_inflater& operator=(const gzip_inflater&) = delete;
+
+    // Returns the number of bytes inflated into output, or -1 on error.
+    int inflate(const void* input, size_t length, std::vector<int32_t>& output);
+
+    std::vector<int32_t> acquire_buffer();
+    void release_buffer(std::vector<int32_t>&& buffer);
+
+private:
+    bool reset_stream();
+
+    std::unique_ptr<z_stream_s> m_stream;
+    bool m_stream_initialized;
+    std::vector<int32_t> m_buffer;
+};
+
+}
+}
@@ -0,0 +1,181 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace tgl {
+namespace impl {
+
+// An open addressing hash table keyed by msg_id, with linear probing and
+// backward shift deletion so it never accumulates tombstones. msg_ids are
+// never 0, which is used to mark empty slots. The table keeps its capacity
+// after erase, so steady state insert/erase does not allocate.
+template<typename T>
+class msg_id_map
+{
+public:
+    msg_id_map()
+        : m_size(0)
+        , m_shift(64)
+    { }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    T* find(int64_t msg_id)
+    {
+        size_t i = find_slot(msg_id);
+        return i != m_entries.size() ? &m_entries[i].value : nullptr;
+    }
+
+    const T* find(int64_t msg_id) const
+    {
+        return const_cast<msg_id_map*>(this)->find(msg_id);
+    }
+
+    // Returns false if msg_id was already present, in which case its value is replaced.
+    bool insert_or_assign(int64_t msg_id, T value)
+    {
+        assert(msg_id);
+        if ((m_size + 1) * 2 > m_entries.size()) {
+            grow();
+        }
+        size_t mask = m_entries.size() - 1;
+        size_t i = slot_of(msg_id);
+        while (m_entries[i].msg_id && m_entries[i].msg_id != msg_id) {
+            i = (i + 1) & mask;
+        }
+        bool inserted = !m_entries[i].msg_id;
+        m_entries[i].msg_id = msg_id;
+        m_entries[i].value = std::move(value);
+        if (inserted) {
+            m_size++;
+        }
+        return inserted;
+    }
+
+    bool erase(int64_t msg_id)
+    {
+        size_t hole = find_slot(msg_id);
+        if (hole == m_entries.size()) {
+            return false;
+        }
+
+        size_t mask = m_entries.size() - 1;
+        for (size_t i = (hole + 1) & mask; m_entries[i].msg_id; i = (i + 1) & mask) {
+            // Move the entry back into the hole unless its home slot lies
+            // cyclically within (hole, i], where it would become unreachable.
+            size_t home = slot_of(m_entries[i].msg_id);
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                m_entries[hole] = std::move(m_entries[i]);
+                hole = i;
+            }
+        }
+        m_entries[hole].msg_id = 0;
+        m_entries[hole].value = T();
+        m_size--;
+        return true;
+    }
+
+    template<typename F>
+    void for_each(F&& f) const
+    {
+        for (const auto& e: m_entries) {
+            if (e.msg_id) {
+                f(e.msg_id, e.value);
+            }
+        }
+    }
+
+    void clear()
+    {
+        m_entries.clear();
+        m_size = 0;
+        m_shift = 64;
+    }
+
+private:
+    static constexpr size_t INITIAL_CAPACITY = 16;
+
+    struct entry {
+        int64_t msg_id = 0;
+        T value;
+    };
+
+    size_t slot_of(int64_t msg_id) const
+    {
+        // Fibonacci hashing: the low bits of nearly sequential msg_ids differ
+        // by small multiples of 4, which the multiply spreads over the table.
+        return static_cast<size_t>((static_cast<uint64_t>(msg_id) * 0x9e3779b97f4a7c15ULL) >> m_shift);
+    }
+
+    // Returns m_entries.size() if msg_id is not present.
+    size_t find_slot(int64_t msg_id) const
+    {
+        assert(msg_id);
+        if (m_entries.empty()) {
+            return 0;
+        }
+        size_t mask = m_entries.size() - 1;
+        for (size_t i = slot_of(msg_id); m_entries[i].msg_id; i = (i + 1) & mask) {
+            if (m_entries[i].msg_id == msg_id) {
+                return i;
+            }
+        }
+        return m_entries.size();
+    }
+
+    void grow()
+    {
+        std::vector<entry> old_entries;
+        old_entries.swap(m_entries);
+        size_t capacity = old_entries.empty() ? INITIAL_CAPACITY : old_entries.size() * 2;
+        m_entries.resize(capacity);
+        m_shift = 64;
+        while (capacity > 1) {
+            capacity >>= 1;
+            m_shift--;
+        }
+        size_t mask = m_entries.size() - 1;
+        for (auto& e: old_entries) {
+            if (!e.msg_id) {
+                continue;
+            }
+            size_t i = slot_of(e.msg_id);
+            while (m_entries[i].msg_id) {
+                i = (i + 1) & mask;
+            }
+            m_entries[i] = std::move(e);
+        }
+    }
+
+    std::vector<entry> m_entries;
+    size_t m_size;
+    unsigned m_shift;
+};
+
+}
+}
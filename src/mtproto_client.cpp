@@ -27,6 +27,7 @@
 #include "auto/auto_types.h"
 #include "crypto/crypto_aes.h"
 #include "crypto/crypto_bn.h"
+#include "crypto/crypto_mtproto.h"
 #include "crypto/crypto_rand.h"
 #include "crypto/crypto_rsa_pem.h"
 #include "crypto/crypto_sha.h"
@@ -63,8 +64,18 @@ namespace impl {
 static constexpr double SESSION_CLEANUP_TIMEOUT = 5.0;
 static constexpr int MAX_MESSAGE_INTS = 1048576;
 static constexpr int ACK_TIMEOUT = 1;
-static constexpr size_t MAX_SECONDARY_WORKERS_PER_SESSION = 3;
-static constexpr double MAX_SECONDARY_WORKER_IDLE_TIME = 15.0;
+static constexpr double RTT_SMOOTHING_FACTOR = 0.125;
+static constexpr int64_t MIN_RESTORED_TEMP_KEY_LIFETIME = 60;
+// The server hands out at most 64 salts of 30 minutes to an hour each.
+static constexpr int32_t FUTURE_SALTS_COUNT = 32;
+// Fetch more salts when the cached ones run out within this many seconds.
+static constexpr double FUTURE_SALTS_REFILL_MARGIN = 3600;
+static constexpr double FUTURE_SALTS_RETRY_INTERVAL = 60;
+static constexpr size_t MAX_RETAINED_READ_BUFFER_SIZE = 1024 * 1024;
+static constexpr size_t MAX_BATCHED_MESSAGE_INTS = 1024;
+static constexpr size_t MAX_CONTAINER_INTS = 8192;
+static constexpr size_t MAX_CONTAINER_MESSAGES = 1020;
+static constexpr size_t MAX_REMEMBERED_CONTAINERS = 32;
 
 #pragma pack(push,4)
 struct encrypted_message {
@@ -123,13 +134,14 @@ mtproto_client::mtproto_client(user_agent& ua, int32_t id)
     : m_user_agent(ua)
     , m_id(id)
     , m_state(state::init)
+    , m_last_msg_id(0)
     , m_auth_key_id(0)
     , m_temp_auth_key_id(0)
+    , m_temp_auth_key_expires(0)
     , m_server_salt(0)
     , m_server_time_delta(0)
     , m_server_time_udelta(0)
     , m_auth_transfer_in_process(false)
-    , m_active_queries(0)
     , m_authorized(false)
     , m_logged_in(false)
     , m_configured(false)
@@ -166,46 +178,41 @@ bool mtproto_client::try_rpc_execute(const std::shared_ptr<tgl_connection>& c)
     assert(c);
 
     while (true) {
-        if (c->available_bytes_for_read() < 1) {
+        // The abridged transport prefixes every frame with its length in words, as one
+        // byte if it is less than 0x7f and as 0x7f followed by three bytes otherwise.
+        // The prefix and the first word of the frame are peeked at once.
+        size_t available = c->available_bytes_for_read();
+        if (available < 1) {
             return true;
         }
-        unsigned len = 0;
-        ssize_t result = c->peek(&len, 1);
-        TGL_ASSERT_UNUSED(result, result == 1);
-        if (len >= 1 && len <= 0x7e) {
-            if (c->available_bytes_for_read() < 1 + 4 * len) {
-                return true;
-            }
+        unsigned char header[8];
+        ssize_t result = c->peek(header, std::min(available, sizeof(header)));
+        TGL_ASSERT_UNUSED(result, result > 0);
+        size_t header_size;
+        size_t len;
+        if (header[0] >= 1 && header[0] <= 0x7e) {
+            header_size = 1;
+            len = header[0];
         } else {
-            if (c->available_bytes_for_read() < 4) {
-                return true;
-            }
-            result = c->peek(&len, 4);
-            TGL_ASSERT_UNUSED(result, result == 4);
-            len = (len >> 8);
-            if (c->available_bytes_for_read() < 4 + 4 * len) {
+            if (available < 4) {
                 return true;
             }
-            len = 0x7f;
+            header_size = 4;
+            len = header[1] | (header[2] << 8) | (header[3] << 16);
         }
-
-        if (len >= 1 && len <= 0x7e) {
-            unsigned t = 0;
-            result = c->read(&t, 1);
-            TGL_ASSERT_UNUSED(result, result == 1);
-            TGL_ASSERT(t == len);
-            TGL_ASSERT(len >= 1);
-        } else {
-            TGL_ASSERT(len == 0x7f);
-            result = c->read(&len, 4);
-            TGL_ASSERT_UNUSED(result, result == 4);
-            len = (len >> 8);
-            TGL_ASSERT(len >= 1);
+        if (!len) {
+            TGL_WARNING("empty frame from DC " << m_id << ", closing connection");
+            return false;
         }
         len *= 4;
+        if (available < header_size + len) {
+            return true;
+        }
+
         int op;
-        result = c->peek(&op, 4);
-        TGL_ASSERT_UNUSED(result, result == 4);
+        memcpy(&op, header + header_size, 4);
+        result = c->read(header, header_size);
+        TGL_ASSERT_UNUSED(result, result == static_cast<ssize_t>(header_size));
         if (!rpc_execute(c, op, len)) {
             return false;
         }
@@ -214,6 +221,60 @@ bool mtproto_client::try_rpc_execute(const std::shared_ptr<tgl_connection>& c)
 
 #define MAX_RESPONSE_SIZE        (1L << 24)
 
+// Outgoing frames are built with room for the longest length prefix in front of
+// the message, so the whole frame can be handed to the connection in one buffer.
+static constexpr size_t FRAME_HEADROOM = 4;
+
+void mtproto_client::rpc_send_frame(const std::shared_ptr<tgl_connection>& c, std::vector<char>&& frame)
+{
+    assert(frame.size() > FRAME_HEADROOM);
+    size_t len = frame.size() - FRAME_HEADROOM;
+    assert(!(len & 0xfc000003));
+
+    int32_t total_len = len >> 2;
+    size_t offset;
+    if (total_len < 0x7f) {
+        offset = FRAME_HEADROOM - 1;
+        frame[offset] = static_cast<char>(total_len);
+    } else {
+        offset = 0;
+        total_len = (total_len << 8) | 0x7f;
+        memcpy(frame.data(), &total_len, 4);
+    }
+
+    // The frames sent in the same event loop iteration are written to each connection in
+    // one batch and flushed once.
+    auto it = std::find_if(m_unsent_frames.begin(), m_unsent_frames.end(),
+            [&c](const std::pair<std::shared_ptr<tgl_connection>, std::vector<tgl_write_buffer>>& frames) { return frames.first == c; });
+    if (it == m_unsent_frames.end()) {
+        m_unsent_frames.emplace_back(c, std::vector<tgl_write_buffer>());
+        it = m_unsent_frames.end() - 1;
+    }
+    it->second.push_back(tgl_write_buffer { std::move(frame), offset });
+
+    if (!m_send_frames_timer) {
+        std::weak_ptr<mtproto_client> weak_this(shared_from_this());
+        m_send_frames_timer = m_user_agent.timer_factory()->create_timer([weak_this] {
+            if (auto shared_this = weak_this.lock()) {
+                shared_this->send_unsent_frames();
+            }
+        });
+    }
+    if (m_unsent_frames.size() == 1 && it->second.size() == 1) {
+        m_send_frames_timer->start(0);
+    }
+}
+
+void mtproto_client::send_unsent_frames()
+{
+    auto unsent_frames = std::move(m_unsent_frames);
+    m_unsent_frames.clear();
+    for (auto& frames: unsent_frames) {
+        frames.first->writev(std::move(frames.second));
+        frames.first->flush();
+    }
+}
+
 void mtproto_client::rpc_send_packet(const char* data, size_t len)
 {
     struct {
@@ -227,44 +288,12 @@ void mtproto_client::rpc_send_packet(const char* data, size_t len)
     unenc_msg_header.out_msg_id = generate_next_msg_id();
     unenc_msg_header.msg_len = len;
 
-    int total_len = len + 20;
-    assert(total_len > 0 && !(total_len & 0xfc000003));
-    total_len >>= 2;
-    TGL_DEBUG("writing packet: total_len = " << total_len << ", len = " << len);
+    TGL_DEBUG("writing packet: total_len = " << (len + 20) / 4 << ", len = " << len);
 
-    const std::shared_ptr<tgl_connection>& c = m_session->primary_worker->connection;
-    if (total_len < 0x7f) {
-        int result = c->write(&total_len, 1);
-        TGL_ASSERT_UNUSED(result, result == 1);
-    } else {
-        total_len = (total_len << 8) | 0x7f;
-        int result = c->write(&total_len, 4);
-        TGL_ASSERT_UNUSED(result, result == 4);
-    }
-    c->write(&unenc_msg_header, 20);
-    c->write(data, len);
-    c->flush();
-}
-
-static int rpc_send_message(const std::shared_ptr<tgl_connection>& c, void* data, int len)
-{
-    assert(len > 0 && !(len & 0xfc000003));
-
-    int total_len = len >> 2;
-    if (total_len < 0x7f) {
-        int result = c->write(&total_len, 1);
-        TGL_ASSERT_UNUSED(result, result == 1);
-    } else {
-        total_len = (total_len << 8) | 0x7f;
-        int result = c->write(&total_len, 4);
-        TGL_ASSERT_UNUSED(result, result == 4);
-    }
-
-    int result = c->write(data, len);
-    TGL_ASSERT_UNUSED(result, result == len);
-    c->flush();
-
-    return 1;
+    std::vector<char> frame(FRAME_HEADROOM + 20 + len);
+    memcpy(frame.data() + FRAME_HEADROOM, &unenc_msg_header, 20);
+    memcpy(frame.data() + FRAME_HEADROOM + 20, data, len);
+    rpc_send_frame(m_session->primary_worker->connection, std::move(frame));
 }
 
 static int check_unauthorized_header(tgl_in_buffer* in)
@@ -698,6 +727,7 @@ bool mtproto_client::process_auth_complete(const char* packet, int len, bool tem
         bind_temp_auth_key(m_user_agent.temp_key_expire_time());
     } else {
         set_authorized();
+        store_keys();
         if (m_user_agent.pfs_enabled()) {
             create_temp_auth_key();
         } else {
@@ -755,6 +785,7 @@ void mtproto_client::bind_temp_auth_key(int32_t temp_key_expire_time)
     }
     s.out_i64(m_session->session_id);
     int expires = tgl_get_system_time() + m_server_time_delta + temp_key_expire_time;
+    m_temp_auth_key_expires = expires;
     s.out_i32(expires);
 
     int data[1000];
@@ -781,34 +812,40 @@ double mtproto_client::get_server_time()
 int64_t mtproto_client::generate_next_msg_id()
 {
     int64_t next_id = static_cast<int64_t>(get_server_time()*(1LL << 32)) & -4;
-    if (next_id <= m_session->last_msg_id) {
-        next_id = m_session->last_msg_id += 4;
+    // The ids are shared by the main and the media session so that they stay unique
+    // among the client's active queries.
+    if (next_id <= m_last_msg_id) {
+        next_id = m_last_msg_id += 4;
     } else {
-        m_session->last_msg_id = next_id;
+        m_last_msg_id = next_id;
     }
     return next_id;
 }
 
-void mtproto_client::init_enc_msg(encrypted_message& enc_msg, bool useful)
+int32_t mtproto_client::generate_next_seq_no(struct session& s, bool useful)
+{
+    int32_t seq_no = s.seq_no;
+    if (useful) {
+        seq_no |= 1;
+    }
+    s.seq_no += 2;
+    return seq_no;
+}
+
+void mtproto_client::init_enc_msg(const struct session& s, encrypted_message& enc_msg, int64_t msg_id, int32_t seq_no)
 {
     assert(m_state == state::authorized);
     assert(m_temp_auth_key_id);
-    assert(m_session);
+    assert(s.session_id);
 
     enc_msg.auth_key_id = m_temp_auth_key_id;
-    enc_msg.server_salt = m_server_salt;
-    while (!m_session->session_id) {
-        tgl_secure_random(reinterpret_cast<unsigned char*>(&m_session->session_id), 8);
-    }
-    enc_msg.session_id = m_session->session_id;
-    if (!enc_msg.msg_id) {
-        enc_msg.msg_id = generate_next_msg_id();
-    }
-    enc_msg.seq_no = m_session->seq_no;
-    if (useful) {
-        enc_msg.seq_no |= 1;
+    if (!m_future_salts.empty()) {
+        update_server_salt();
     }
-    m_session->seq_no += 2;
+    enc_msg.server_salt = m_server_salt;
+    enc_msg.session_id = s.session_id;
+    enc_msg.msg_id = msg_id;
+    enc_msg.seq_no = seq_no;
 };
 
 void mtproto_client::init_enc_msg_inner_temp(encrypted_message& enc_msg, int64_t msg_id)
@@ -822,20 +859,13 @@ void mtproto_client::init_enc_msg_inner_temp(encrypted_message& enc_msg, int64_t
 
 static int aes_encrypt_message(unsigned char* key, struct encrypted_message* enc)
 {
-    unsigned char sha1_buffer[20];
-    memset(sha1_buffer, 0, sizeof(sha1_buffer));
     const int MINSZ = offsetof(struct encrypted_message, message);
     const int UNENCSZ = offsetof(struct encrypted_message, server_salt);
 
     int enc_len = (MINSZ - UNENCSZ) + enc->msg_len;
     assert(enc->msg_len >= 0 && enc->msg_len <= MAX_MESSAGE_INTS * 4 - 16 && !(enc->msg_len & 3));
-    TGLC_sha1((unsigned char *) &enc->server_salt, enc_len, sha1_buffer);
-    memcpy(enc->msg_key, sha1_buffer + 4, 16);
-    TGLC_aes_key aes_key;
-    unsigned char aes_iv[32];
-    tgl_init_aes_auth(&aes_key, aes_iv, key, enc->msg_key, AES_ENCRYPT);
-    return tgl_pad_aes_encrypt(&aes_key, aes_iv, (unsigned char *) &enc->server_salt, enc_len,
-            (unsigned char*)&enc->server_salt, tgl_pad_aes_encrypt_dest_buffer_size(enc_len));
+    return TGLC_mtproto_encrypt_message(key, reinterpret_cast<unsigned char*>(&enc->server_salt), enc_len,
+            tgl_pad_aes_encrypt_dest_buffer_size(enc_len), enc->msg_key);
 }
 
 static std::unique_ptr<char[]> allocate_encrypted_message_buffer(int msg_ints)
@@ -851,7 +881,8 @@ static std::unique_ptr<char[]> allocate_encrypted_message_buffer(int msg_ints)
 
 int64_t mtproto_client::send_message_impl(
         const int32_t* msg, size_t msg_ints, int64_t msg_id_override,
-        bool force_send, bool useful, bool allow_secondary_connections, bool count_work_load)
+        bool force_send, bool useful, bool file_transfer, bool count_work_load,
+        const struct session** sent_session)
 {
     if (!m_session || !m_session->primary_worker) {
         TGL_ERROR("there is no session or primary connection");
@@ -870,7 +901,22 @@ int64_t mtproto_client::send_message_impl(
 
     assert(is_configured() || force_send);
 
-    auto best_worker = select_best_worker(allow_secondary_connections);
+    struct session* s = m_session.get();
+    if (file_transfer && (m_media_session || m_user_agent.max_secondary_connections())) {
+        s = &media_session();
+    }
+
+    auto best_worker = select_best_worker(*s, count_work_load);
+    if (!best_worker) {
+        // Acks belong to the session whose messages they acknowledge.
+        if (!count_work_load) {
+            TGL_DEBUG("no media connection is available for DC " << m_id << ", keeping the acks");
+            return -1;
+        }
+        TGL_DEBUG("no media connection is available for DC " << m_id << ", using the main session");
+        s = m_session.get();
+        best_worker = select_best_worker(*s, count_work_load);
+    }
     assert(best_worker);
 
     if (!best_worker->connection || best_worker->connection->status() == tgl_connection_status::disconnected) {
@@ -879,86 +925,301 @@ int64_t mtproto_client::send_message_impl(
         return -1;
     }
 
-    std::unique_ptr<char[]> buffer = allocate_encrypted_message_buffer(msg_ints);
-    encrypted_message* enc_msg = reinterpret_cast<encrypted_message*>(buffer.get());
+    bool batch = m_user_agent.message_batching_enabled() && msg_ints <= MAX_BATCHED_MESSAGE_INTS;
+    if (!batch) {
+        // Keep the messages which were queued before this one ahead of it.
+        flush_queued_messages(*s, best_worker);
+    }
+
+    int64_t msg_id = msg_id_override ? msg_id_override : generate_next_msg_id();
+    int32_t seq_no = generate_next_seq_no(*s, useful);
+
+    if (count_work_load) {
+        worker_job_started(*s, best_worker, msg_id, msg_ints * 4);
+    }
+
+    if (batch) {
+        queue_message(*s, best_worker, msg, msg_ints, msg_id, seq_no);
+    } else {
+        send_encrypted_message(*s, best_worker, msg, msg_ints, msg_id, seq_no);
+    }
+
+    if (sent_session) {
+        *sent_session = s;
+    }
+
+    return msg_id;
+}
+
+void mtproto_client::send_encrypted_message(const struct session& s, const std::shared_ptr<worker>& w,
+        const int32_t* msg, size_t msg_ints, int64_t msg_id, int32_t seq_no)
+{
+    // The message is encrypted in place in the frame which is then handed over to
+    // the connection, so the body is copied only once here.
+    const int UNENCSZ = offsetof(struct encrypted_message, server_salt);
+    const int MINSZ = offsetof(struct encrypted_message, message);
+    int encrypted_size = tgl_pad_aes_encrypt_dest_buffer_size(MINSZ - UNENCSZ + msg_ints * 4);
+    std::vector<char> frame(FRAME_HEADROOM + UNENCSZ + encrypted_size);
+    encrypted_message* enc_msg = reinterpret_cast<encrypted_message*>(frame.data() + FRAME_HEADROOM);
 
     memcpy(enc_msg->message, msg, msg_ints * 4);
     enc_msg->msg_len = msg_ints * 4;
 
-    enc_msg->msg_id = msg_id_override;
-    init_enc_msg(*enc_msg, useful);
-    int64_t msg_id = enc_msg->msg_id;
+    init_enc_msg(s, *enc_msg, msg_id, seq_no);
 
     int l = aes_encrypt_message(m_temp_auth_key.data(), enc_msg);
-    assert(l > 0);
+    TGL_ASSERT_UNUSED(l, l == encrypted_size);
 
-    if (count_work_load) {
-        best_worker->work_load.insert(msg_id);
+    rpc_send_frame(w->connection, std::move(frame));
+}
+
+void mtproto_client::queue_message(struct session& s, const std::shared_ptr<worker>& w,
+        const int32_t* msg, size_t msg_ints, int64_t msg_id, int32_t seq_no)
+{
+    if (w->queued_msg_ids.size() >= MAX_CONTAINER_MESSAGES
+            || w->queued_messages.size() + 4 + msg_ints > MAX_CONTAINER_INTS) {
+        flush_queued_messages(s, w);
     }
 
-    const int UNENCSZ = offsetof(struct encrypted_message, server_salt);
-    rpc_send_message(best_worker->connection, enc_msg, l + UNENCSZ);
+    // message msg_id:long seqno:int bytes:int body:Object = Message;
+    int32_t header[4];
+    memcpy(header, &msg_id, 8);
+    header[2] = seq_no;
+    header[3] = msg_ints * 4;
+    w->queued_messages.insert(w->queued_messages.end(), header, header + 4);
+    w->queued_messages.insert(w->queued_messages.end(), msg, msg + msg_ints);
+    w->queued_msg_ids.push_back(msg_id);
 
-    return msg_id;
+    if (!s.flush_timer) {
+        std::weak_ptr<mtproto_client> weak_this(shared_from_this());
+        bool media = &s == m_media_session.get();
+        s.flush_timer = m_user_agent.timer_factory()->create_timer([weak_this, media] {
+            if (auto shared_this = weak_this.lock()) {
+                if (auto s = shared_this->session(media)) {
+                    s->flush_timer_armed = false;
+                    shared_this->flush_all_queued_messages(*s);
+                }
+            }
+        });
+    }
+
+    // One timer flushes the queues of all the session's workers. It is not restarted while
+    // armed, so a message waits no longer than the batching window however many are queued
+    // after it.
+    if (!s.flush_timer_armed) {
+        s.flush_timer_armed = true;
+        s.flush_timer->start(m_user_agent.message_batching_window());
+    }
 }
 
-std::shared_ptr<worker> mtproto_client::select_best_worker(bool allow_secondary_workers)
+void mtproto_client::flush_queued_messages(struct session& s, const std::shared_ptr<worker>& w)
 {
-    assert(m_session);
-    assert(m_session->primary_worker);
+    if (w->queued_msg_ids.empty()) {
+        return;
+    }
 
-    std::shared_ptr<worker> best_worker = m_session->primary_worker;
+    std::vector<int32_t> messages = std::move(w->queued_messages);
+    std::vector<int64_t> msg_ids = std::move(w->queued_msg_ids);
+    w->queued_messages.clear();
+    w->queued_msg_ids.clear();
 
-    if (!allow_secondary_workers) {
-        return best_worker;
+    if (!w->connection || w->connection->status() == tgl_connection_status::disconnected
+            || w->connection->status() == tgl_connection_status::closed) {
+        move_queued_messages(s, w, std::move(messages), std::move(msg_ids));
+        return;
+    }
+
+    if (msg_ids.size() == 1) {
+        int64_t msg_id;
+        memcpy(&msg_id, messages.data(), 8);
+        assert(msg_id == msg_ids[0]);
+        send_encrypted_message(s, w, messages.data() + 4, messages.size() - 4, msg_id, messages[2]);
+        return;
+    }
+
+    TGL_DEBUG("sending " << msg_ids.size() << " messages in one container to DC " << m_id);
+
+    // msg_container#73f1f8dc messages:vector<message> = MessageContainer;
+    messages.insert(messages.begin(), { static_cast<int32_t>(CODE_msg_container), static_cast<int32_t>(msg_ids.size()) });
+    int64_t container_msg_id = generate_next_msg_id();
+    send_encrypted_message(s, w, messages.data(), messages.size(), container_msg_id, generate_next_seq_no(s, false));
+
+    s.sent_containers.emplace_back(container_msg_id, std::move(msg_ids));
+    if (s.sent_containers.size() > MAX_REMEMBERED_CONTAINERS) {
+        s.sent_containers.pop_front();
+    }
+}
+
+// The msg_ids and seq_nos of queued messages belong to the session, not to the connection,
+// so another worker of the session can send them when the connection of theirs stopped.
+// Without one their queries are resent, which holds them back until the session is
+// connected again.
+void mtproto_client::move_queued_messages(struct session& s, const std::shared_ptr<worker>& stopped,
+        std::vector<int32_t>&& messages, std::vector<int64_t>&& msg_ids)
+{
+    bool has_jobs = false;
+    for (int64_t id: msg_ids) {
+        const in_flight_message* message = s.in_flight_messages.find(id);
+        has_jobs = has_jobs || (message && message->owner == stopped);
+    }
+
+    auto w = select_best_worker(s, has_jobs);
+    if (!w || w == stopped || !w->connection || w->connection->status() == tgl_connection_status::disconnected) {
+        TGL_WARNING("no connection to DC " << m_id << " for " << msg_ids.size() << " queued messages, resending their queries");
+        for (int64_t id: msg_ids) {
+            restart_query(s, id);
+        }
+        return;
+    }
+
+    TGL_DEBUG("moving " << msg_ids.size() << " queued messages of a stopped worker of DC " << m_id);
+    for (int64_t id: msg_ids) {
+        in_flight_message* message = s.in_flight_messages.find(id);
+        if (message && message->owner == stopped) {
+            stopped->work_load--;
+            stopped->bytes_in_flight -= message->bytes;
+            w->work_load++;
+            w->bytes_in_flight += message->bytes;
+            message->owner = w;
+        }
+    }
+
+    // Sent apart from what the worker has queued itself, so neither container grows too big.
+    flush_queued_messages(s, w);
+    w->queued_messages = std::move(messages);
+    w->queued_msg_ids = std::move(msg_ids);
+    flush_queued_messages(s, w);
+}
+
+void mtproto_client::flush_all_queued_messages(struct session& s)
+{
+    if (s.primary_worker) {
+        flush_queued_messages(s, s.primary_worker);
+    }
+
+    // Flushing may open workers when the messages of a stopped one are moved.
+    std::vector<std::shared_ptr<worker>> workers(s.secondary_workers.begin(), s.secondary_workers.end());
+    for (const auto& w: workers) {
+        flush_queued_messages(s, w);
+    }
+}
+
+const std::vector<int64_t>* mtproto_client::sent_container_msg_ids(const struct session& s, int64_t msg_id) const
+{
+    for (const auto& container: s.sent_containers) {
+        if (container.first == msg_id) {
+            return &container.second;
+        }
+    }
+
+    return nullptr;
+}
+
+// When a new message sent through the worker can be expected to be answered: after one
+// round trip plus the time the worker needs to get through what it already has in flight.
+// A busy worker which hasn't answered anything yet is assumed to be slow.
+static double expected_completion_time(const worker& w)
+{
+    if (!w.work_load) {
+        return w.srtt;
+    }
+    if (!w.srtt || !w.throughput) {
+        return std::numeric_limits<double>::max();
+    }
+    return w.srtt + w.bytes_in_flight / w.throughput;
+}
+
+// The media session spreads file transfers over its workers: the one expected to answer
+// first wins, and the one with fewer bytes waiting for an answer breaks ties.
+static bool is_less_busy(const worker& a, const worker& b)
+{
+    double a_time = expected_completion_time(a);
+    double b_time = expected_completion_time(b);
+    if (a_time != b_time) {
+        return a_time < b_time;
+    }
+    return a.bytes_in_flight < b.bytes_in_flight;
+}
+
+std::shared_ptr<worker> mtproto_client::start_media_worker(struct session& s)
+{
+    std::weak_ptr<mtproto_client> weak_this(shared_from_this());
+    auto connection = m_user_agent.connection_factory()->create_connection(
+            m_ipv4_options, m_ipv6_options, weak_this);
+    connection->open();
+    auto w = std::make_shared<worker>(connection);
+    w->live_timer = m_user_agent.timer_factory()->create_timer([w, weak_this]{
+        auto client = weak_this.lock();
+        if (client && w->work_load) {
+            TGL_DEBUG("a worker idle timer fired but it still has " << w->work_load << " jobs to do, refreshing the timer");
+            w->live_timer->start(client->m_user_agent.secondary_connection_idle_timeout());
+            return;
+        }
+        struct session* media = client ? client->m_media_session.get() : nullptr;
+        if (media
+                && media->secondary_workers.size() <= client->m_user_agent.min_secondary_connections()
+                && w->connection && w->connection->status() != tgl_connection_status::disconnected) {
+            TGL_DEBUG("keeping an idle worker open");
+            return;
+        }
+        if (media) {
+            client->flush_queued_messages(*media, w);
+        }
+        if (w->connection) {
+           TGL_DEBUG("an idle worker stopped");
+           w->connection->close();
+        }
+        if (media) {
+            media->secondary_workers.erase(w);
+            TGL_DEBUG("now we have " << media->secondary_workers.size() << " media workers");
+        }
+    });
+    w->live_timer->start(m_user_agent.secondary_connection_idle_timeout());
+    s.secondary_workers.insert(w);
+    TGL_DEBUG("started a media worker, now we have " << s.secondary_workers.size() << " media workers");
+    return w;
+}
+
+// Messages which are not counted in the work load, like acks, only use a worker which is
+// already open and don't keep it from closing when idle.
+std::shared_ptr<worker> mtproto_client::select_best_worker(struct session& s, bool new_job)
+{
+    if (s.primary_worker) {
+        return s.primary_worker;
+    }
+
+    assert(&s == m_media_session.get());
+
+    // The media session opens its minimum number of connections with its first transfer,
+    // and again after some of them were closed.
+    size_t min_workers = std::min(m_user_agent.min_secondary_connections(), m_user_agent.max_secondary_connections());
+    while (new_job && s.secondary_workers.size() < min_workers) {
+        start_media_worker(s);
     }
 
-    auto min_work_load = best_worker->work_load.size();
-    for (const auto& w: m_session->secondary_workers) {
+    std::shared_ptr<worker> best_worker;
+    for (const auto& w: s.secondary_workers) {
         if (!w->connection || w->connection->status() == tgl_connection_status::disconnected) {
             continue;
         }
-        if (w->work_load.size() < min_work_load) {
-            min_work_load = w->work_load.size();
+        if (!best_worker || is_less_busy(*w, *best_worker)) {
             best_worker = w;
         }
     }
 
-    if (best_worker->work_load.size() != 0 && m_session->secondary_workers.size() < MAX_SECONDARY_WORKERS_PER_SESSION) {
-        std::weak_ptr<mtproto_client> weak_this(shared_from_this());
-        auto connection = m_user_agent.connection_factory()->create_connection(
-                m_ipv4_options, m_ipv6_options, weak_this);
-        connection->open();
-        best_worker = std::make_shared<worker>(connection);
-        best_worker->live_timer = m_user_agent.timer_factory()->create_timer([best_worker, weak_this]{
-            if (best_worker->work_load.size()) {
-                TGL_DEBUG("a worker idle timer fired but it still has " << best_worker->work_load.size() << " jobs to do, refreshing the timer");
-                best_worker->live_timer->start(MAX_SECONDARY_WORKER_IDLE_TIME);
-                return;
-            }
-            if (best_worker->connection) {
-               TGL_DEBUG("an idle worker stopped");
-               best_worker->connection->close();
-            }
-            if (auto client = weak_this.lock()) {
-                if (client->m_session) {
-                    client->m_session->secondary_workers.erase(best_worker);
-                    TGL_DEBUG("now we have " << client->m_session->secondary_workers.size() << " secondary workers");
-                }
-            }
-        });
-        m_session->secondary_workers.insert(best_worker);
-        TGL_DEBUG("started a secondary worker, now we have " << m_session->secondary_workers.size() << " secondary workers");
+    if (new_job && (!best_worker || best_worker->work_load != 0) && s.secondary_workers.size() < m_user_agent.max_secondary_connections()) {
+        best_worker = start_media_worker(s);
     }
 
-    if (best_worker == m_session->primary_worker) {
-        TGL_DEBUG("selected the primary worker with work_load " << best_worker->work_load.size());
-    } else {
-        assert(best_worker->live_timer);
-        best_worker->live_timer->cancel();
-        TGL_DEBUG("selected a secondary worker with work_load " << best_worker->work_load.size());
+    if (!best_worker || !new_job) {
+        return best_worker;
     }
 
+    assert(best_worker->live_timer);
+    best_worker->live_timer->cancel();
+    TGL_DEBUG("selected a media worker with work_load " << best_worker->work_load
+            << " (" << best_worker->bytes_in_flight << " bytes), srtt " << best_worker->srtt);
+
     return best_worker;
 }
 
@@ -984,7 +1245,7 @@ int mtproto_client::encrypt_inner_temp(const int32_t* msg, int msg_ints, void* d
     return length + UNENCSZ;
 }
 
-int mtproto_client::work_container(tgl_in_buffer* in, int64_t msg_id)
+int mtproto_client::work_container(struct session& s, tgl_in_buffer* in, int64_t msg_id)
 {
     TGL_DEBUG("work_container: msg_id = " << msg_id);
     auto result = fetch_i32(in);
@@ -994,15 +1255,15 @@ int mtproto_client::work_container(tgl_in_buffer* in, int64_t msg_id)
         int64_t id = fetch_i64(in);
         fetch_i32(in); // seq_no
         if (id & 1) {
-            if (!m_session) {
+            if (!is_current_session(s)) {
                 return -1;
             }
-            insert_msg_id(id);
+            insert_msg_id(s, id);
         }
         int32_t bytes = fetch_i32(in);
         const int32_t* t = in->end;
         in->end = in->ptr + (bytes / 4);
-        int r = rpc_execute_answer(in, id);
+        int r = rpc_execute_answer(s, in, id);
         if (r < 0) {
             return -1;
         }
@@ -1013,9 +1274,9 @@ int mtproto_client::work_container(tgl_in_buffer* in, int64_t msg_id)
     return 0;
 }
 
-int mtproto_client::work_new_session_created(tgl_in_buffer* in, int64_t msg_id)
+int mtproto_client::work_new_session_created(const struct session& s, tgl_in_buffer* in, int64_t msg_id)
 {
-    if (!m_session) {
+    if (!is_current_session(s)) {
         return -1;
     }
     TGL_DEBUG("work_new_session_created: msg_id = " << msg_id << ", DC " << m_id);
@@ -1024,8 +1285,10 @@ int mtproto_client::work_new_session_created(tgl_in_buffer* in, int64_t msg_id)
     fetch_i64(in); // first message id
     fetch_i64(in); // unique_id
     m_server_salt = fetch_i64(in);
+    store_keys();
 
-    if (m_user_agent.is_started()
+    if (&s == m_session.get()
+            && m_user_agent.is_started()
             && !m_user_agent.is_diff_locked()
             && m_user_agent.active_client()->is_logged_in()) {
         m_user_agent.get_difference(false, nullptr);
@@ -1035,7 +1298,7 @@ int mtproto_client::work_new_session_created(tgl_in_buffer* in, int64_t msg_id)
 
 void mtproto_client::ack_query(int64_t msg_id)
 {
-    std::shared_ptr<query> q = m_user_agent.get_active_query(msg_id);
+    std::shared_ptr<query> q = active_query(msg_id);
     if (q) {
         q->ack();
     }
@@ -1057,32 +1320,53 @@ int mtproto_client::work_msgs_ack(tgl_in_buffer* in, int64_t msg_id)
     return 0;
 }
 
-void mtproto_client::worker_job_done(int64_t id)
+void mtproto_client::worker_job_started(struct session& s, const std::shared_ptr<worker>& w, int64_t id, size_t bytes)
 {
-    if (!m_session) {
-        return;
+    bool resent = false;
+    if (auto* previous = s.in_flight_messages.find(id)) {
+        // A message resent with the same id now belongs to the worker it was resent through.
+        previous->resent = true;
+        resent = true;
+        worker_job_done(s, id);
     }
 
-    if (const auto& w = m_session->primary_worker) {
-        auto it = w->work_load.lower_bound(id);
-        if (it != w->work_load.end() && *it == id) {
-            w->work_load.erase(it);
-            assert(!w->live_timer);
-            return;
-        }
+    in_flight_message message;
+    message.owner = w;
+    message.bytes = bytes;
+    message.sent_time = tgl_get_monotonic_time();
+    message.resent = resent;
+    s.in_flight_messages.insert_or_assign(id, std::move(message));
+    w->work_load++;
+    w->bytes_in_flight += bytes;
+}
+
+void mtproto_client::worker_job_done(struct session& s, int64_t id)
+{
+    auto* message = s.in_flight_messages.find(id);
+    if (!message) {
+        return;
     }
 
-    for (const auto& w: m_session->secondary_workers) {
-        auto it = w->work_load.lower_bound(id);
-        if (it != w->work_load.end() && *it == id) {
-            w->work_load.erase(it);
-            if (w->work_load.empty() && w->live_timer) {
-                assert(w != m_session->primary_worker);
-                w->live_timer->start(MAX_SECONDARY_WORKER_IDLE_TIME);
-            }
-            break;
+    in_flight_message done = std::move(*message);
+    s.in_flight_messages.erase(id);
+
+    const auto& w = done.owner;
+    assert(w->work_load);
+    assert(w->bytes_in_flight >= done.bytes);
+    w->work_load--;
+    w->bytes_in_flight -= done.bytes;
+    if (!done.resent) {
+        double rtt = tgl_get_monotonic_time() - done.sent_time;
+        w->srtt = w->srtt ? w->srtt + RTT_SMOOTHING_FACTOR * (rtt - w->srtt) : rtt;
+        if (rtt > 0) {
+            double throughput = done.bytes / rtt;
+            w->throughput = w->throughput ? w->throughput + RTT_SMOOTHING_FACTOR * (throughput - w->throughput) : throughput;
         }
     }
+    if (!w->work_load && w->live_timer) {
+        assert(w != s.primary_worker);
+        w->live_timer->start(m_user_agent.secondary_connection_idle_timeout());
+    }
 }
 
 int mtproto_client::query_error(tgl_in_buffer* in, int64_t id)
@@ -1093,7 +1377,7 @@ int mtproto_client::query_error(tgl_in_buffer* in, int64_t id)
     int error_len = prefetch_strlen(in);
     std::string error_string = std::string(fetch_str(in, error_len), error_len);
 
-    std::shared_ptr<query> q = m_user_agent.get_active_query(id);
+    std::shared_ptr<query> q = active_query(id);
     if (!q) {
         TGL_WARNING("error for unknown query #" << id << " #" << error_code << ": " << error_string);
     } else {
@@ -1106,7 +1390,7 @@ int mtproto_client::query_error(tgl_in_buffer* in, int64_t id)
 
 int mtproto_client::query_result(tgl_in_buffer* in, int64_t id)
 {
-    std::shared_ptr<query> q = m_user_agent.get_active_query(id);
+    std::shared_ptr<query> q = active_query(id);
     if (!q) {
         in->ptr = in->end;
         return 0;
@@ -1115,14 +1399,14 @@ int mtproto_client::query_result(tgl_in_buffer* in, int64_t id)
     return q->handle_result(in);
 }
 
-int mtproto_client::work_rpc_result(tgl_in_buffer* in, int64_t msg_id)
+int mtproto_client::work_rpc_result(struct session& s, tgl_in_buffer* in, int64_t msg_id)
 {
     TGL_DEBUG("work_rpc_result: msg_id = " << msg_id);
     auto result = fetch_i32(in);
     TGL_ASSERT_UNUSED(result, result == static_cast<int32_t>(CODE_rpc_result));
     int64_t id = fetch_i64(in);
 
-    worker_job_done(id);
+    worker_job_done(s, id);
 
     uint32_t op = prefetch_i32(in);
     if (op == CODE_rpc_error) {
@@ -1132,32 +1416,43 @@ int mtproto_client::work_rpc_result(tgl_in_buffer* in, int64_t msg_id)
     }
 }
 
-int mtproto_client::work_packed(tgl_in_buffer* in, int64_t msg_id)
+int mtproto_client::work_packed(struct session& s, tgl_in_buffer* in, int64_t msg_id)
 {
     auto result = fetch_i32(in);
     TGL_ASSERT_UNUSED(result, result == static_cast<int32_t>(CODE_gzip_packed));
-    constexpr size_t MAX_PACKED_SIZE = 1 << 24;
-    std::unique_ptr<int32_t[]> unzipped_buffer(new int32_t[MAX_PACKED_SIZE >> 2]);
 
     ssize_t l = prefetch_strlen(in);
-    const char* s = fetch_str(in, l);
+    const char* packed = fetch_str(in, l);
 
-    int total_out = tgl_inflate(s, l, unzipped_buffer.get(), MAX_PACKED_SIZE);
-    tgl_in_buffer new_in = { unzipped_buffer.get(), unzipped_buffer.get() + total_out / 4 };
-    int r = rpc_execute_answer(&new_in, msg_id, true);
+    std::vector<int32_t> unzipped_buffer = m_inflater.acquire_buffer();
+    int total_out = m_inflater.inflate(packed, l, unzipped_buffer);
+    if (total_out < 0) {
+        m_inflater.release_buffer(std::move(unzipped_buffer));
+        return -1;
+    }
+    tgl_in_buffer new_in = { unzipped_buffer.data(), unzipped_buffer.data() + total_out / 4 };
+    int r = rpc_execute_answer(s, &new_in, msg_id, true);
+    m_inflater.release_buffer(std::move(unzipped_buffer));
     return r;
 }
 
-void mtproto_client::restart_query(int64_t msg_id)
+void mtproto_client::restart_query(const struct session& s, int64_t msg_id)
 {
-    std::shared_ptr<query> q = m_user_agent.get_active_query(msg_id);
+    if (const std::vector<int64_t>* msg_ids = sent_container_msg_ids(s, msg_id)) {
+        for (int64_t id: std::vector<int64_t>(*msg_ids)) {
+            restart_query(s, id);
+        }
+        return;
+    }
+
+    std::shared_ptr<query> q = active_query(msg_id);
     if (q) {
         TGL_DEBUG("restarting query " << msg_id);
         q->alarm();
     }
 }
 
-int mtproto_client::work_bad_server_salt(tgl_in_buffer* in)
+int mtproto_client::work_bad_server_salt(const struct session& s, tgl_in_buffer* in)
 {
     auto result = fetch_i32(in);
     TGL_ASSERT_UNUSED(result, result == static_cast<int32_t>(CODE_bad_server_salt));
@@ -1169,20 +1464,128 @@ int mtproto_client::work_bad_server_salt(tgl_in_buffer* in)
             << " error_code = " << error_code << " new_server_salt =" << new_server_salt
             << " old_server_salt = " << m_server_salt);
     m_server_salt = new_server_salt;
-    restart_query(id);
+    if (!m_future_salts.empty()) {
+        // The cached salts are out of date, get fresh ones.
+        m_future_salts.clear();
+        schedule_future_salts_request(0);
+    }
+    store_keys();
+    restart_query(s, id);
     return 0;
 }
 
-int mtproto_client::work_pong(tgl_in_buffer* in)
+int mtproto_client::work_pong(struct session& s, tgl_in_buffer* in)
 {
     auto result = fetch_i32(in);
     TGL_ASSERT_UNUSED(result, result == static_cast<int32_t>(CODE_pong));
     int64_t id = fetch_i64(in); // msg_id
     fetch_i64(in); // ping_id
-    worker_job_done(id);
+    worker_job_done(s, id);
+    return 0;
+}
+
+int mtproto_client::work_future_salts(struct session& s, tgl_in_buffer* in)
+{
+    auto result = fetch_i32(in);
+    TGL_ASSERT_UNUSED(result, result == static_cast<int32_t>(CODE_future_salts));
+    int64_t id = fetch_i64(in); // req_msg_id
+    fetch_i32(in); // now
+    int32_t count = fetch_i32(in);
+    if (count < 0 || in->end - in->ptr < static_cast<int64_t>(count) * 4) {
+        TGL_ERROR("bad future salts count " << count << " from DC " << m_id);
+        return -1;
+    }
+
+    // A bare vector of bare future_salt entries.
+    m_future_salts.clear();
+    for (int32_t i = 0; i < count; ++i) {
+        tgl_future_salt salt;
+        salt.valid_since = fetch_i32(in);
+        salt.valid_until = fetch_i32(in);
+        salt.salt = fetch_i64(in);
+        if (m_future_salts.empty() || salt.valid_since >= m_future_salts.back().valid_since) {
+            m_future_salts.push_back(salt);
+        }
+    }
+    worker_job_done(s, id);
+
+    TGL_DEBUG("got " << m_future_salts.size() << " future salts for DC " << m_id);
+    if (m_future_salts.empty()) {
+        schedule_future_salts_request(FUTURE_SALTS_RETRY_INTERVAL);
+        return 0;
+    }
+
+    update_server_salt();
+    store_keys();
+    schedule_future_salts_request(std::max(FUTURE_SALTS_RETRY_INTERVAL,
+            m_future_salts.back().valid_until - FUTURE_SALTS_REFILL_MARGIN - get_server_time()));
     return 0;
 }
 
+void mtproto_client::request_future_salts()
+{
+    if (!is_configured()) {
+        return;
+    }
+
+    if (!m_future_salts.empty() && m_future_salts.back().valid_until - get_server_time() > FUTURE_SALTS_REFILL_MARGIN) {
+        return;
+    }
+
+    TGL_DEBUG("requesting future salts for DC " << m_id);
+    int32_t buffer[2];
+    buffer[0] = CODE_get_future_salts;
+    buffer[1] = FUTURE_SALTS_COUNT;
+    // Not counted in the work load: a lost request is simply asked again, and would
+    // otherwise stay in flight until the session is reset.
+    send_message_impl(buffer, 2, 0, false, true, false, false);
+
+    // Ask again if the answer gets lost; a successful answer reschedules this.
+    schedule_future_salts_request(FUTURE_SALTS_RETRY_INTERVAL);
+}
+
+void mtproto_client::schedule_future_salts_request(double timeout)
+{
+    if (!m_future_salts_timer) {
+        std::weak_ptr<mtproto_client> weak_this(shared_from_this());
+        m_future_salts_timer = m_user_agent.timer_factory()->create_timer([weak_this] {
+            if (auto shared_this = weak_this.lock()) {
+                shared_this->request_future_salts();
+            }
+        });
+    }
+    m_future_salts_timer->cancel();
+    m_future_salts_timer->start(timeout);
+}
+
+void mtproto_client::clear_future_salts()
+{
+    m_future_salts.clear();
+    if (m_future_salts_timer) {
+        m_future_salts_timer->cancel();
+    }
+}
+
+bool mtproto_client::update_server_salt()
+{
+    double now = get_server_time();
+    while (m_future_salts.size() > 1 && m_future_salts[1].valid_since <= now) {
+        m_future_salts.pop_front();
+    }
+    if (!m_future_salts.empty() && m_future_salts.front().valid_until <= now) {
+        m_future_salts.pop_front();
+    }
+    if (m_future_salts.empty() || m_future_salts.front().valid_since > now) {
+        return false;
+    }
+
+    if (m_server_salt != m_future_salts.front().salt) {
+        TGL_DEBUG("switching to future salt " << m_future_salts.front().salt << " for DC " << m_id);
+        m_server_salt = m_future_salts.front().salt;
+    }
+    return true;
+}
+
 static int work_detailed_info(tgl_in_buffer* in)
 {
     auto result = fetch_i32(in);
@@ -1204,9 +1607,16 @@ static int work_new_detailed_info(tgl_in_buffer* in)
     return 0;
 }
 
-void mtproto_client::regen_query(int64_t msg_id)
+void mtproto_client::regen_query(const struct session& s, int64_t msg_id)
 {
-    std::shared_ptr<query> q = m_user_agent.get_active_query(msg_id);
+    if (const std::vector<int64_t>* msg_ids = sent_container_msg_ids(s, msg_id)) {
+        for (int64_t id: std::vector<int64_t>(*msg_ids)) {
+            regen_query(s, id);
+        }
+        return;
+    }
+
+    std::shared_ptr<query> q = active_query(msg_id);
     if (!q) {
         return;
     }
@@ -1215,48 +1625,48 @@ void mtproto_client::regen_query(int64_t msg_id)
     q->regen();
 }
 
-int mtproto_client::work_bad_msg_notification(tgl_in_buffer* in)
+int mtproto_client::work_bad_msg_notification(const struct session& s, tgl_in_buffer* in)
 {
     auto result = fetch_i32(in);
     TGL_ASSERT_UNUSED(result, result == static_cast<int32_t>(CODE_bad_msg_notification));
     int64_t m1 = fetch_i64(in);
-    int32_t s = fetch_i32(in);
+    int32_t seq = fetch_i32(in);
     int32_t e = fetch_i32(in);
-    TGL_DEBUG("bad_msg_notification: msg_id = " << m1 << ", seq = " << s << ", error = " << e);
+    TGL_DEBUG("bad_msg_notification: msg_id = " << m1 << ", seq = " << seq << ", error = " << e);
     switch (e) {
     // Too low msg id
     case 16:
-        regen_query(m1);
+        regen_query(s, m1);
         break;
     // Too high msg id
     case 17:
-        regen_query(m1);
+        regen_query(s, m1);
         break;
     // Bad container
     case 64:
-        TGL_DEBUG("bad_msg_notification: msg_id = " << m1 << ", seq = " << s << ", error = " << e);
-        regen_query(m1);
+        TGL_DEBUG("bad_msg_notification: msg_id = " << m1 << ", seq = " << seq << ", error = " << e);
+        regen_query(s, m1);
         break;
     default:
-        TGL_DEBUG("bad_msg_notification: msg_id = " << m1 << ", seq = " << s << ", error = " << e);
+        TGL_DEBUG("bad_msg_notification: msg_id = " << m1 << ", seq = " << seq << ", error = " << e);
         break;
     }
 
     return -1;
 }
 
-int mtproto_client::rpc_execute_answer(tgl_in_buffer* in, int64_t msg_id, bool in_gzip)
+int mtproto_client::rpc_execute_answer(struct session& s, tgl_in_buffer* in, int64_t msg_id, bool in_gzip)
 {
     uint32_t op = prefetch_i32(in);
     switch (op) {
     case CODE_msg_container:
-        return work_container(in, msg_id);
+        return work_container(s, in, msg_id);
     case CODE_new_session_created:
-        return work_new_session_created(in, msg_id);
+        return work_new_session_created(s, in, msg_id);
     case CODE_msgs_ack:
         return work_msgs_ack(in, msg_id);
     case CODE_rpc_result:
-        return work_rpc_result(in, msg_id);
+        return work_rpc_result(s, in, msg_id);
     case CODE_update_short:
     case CODE_updates:
     case CODE_update_short_message:
@@ -1269,17 +1679,19 @@ int mtproto_client::rpc_execute_answer(tgl_in_buffer* in, int64_t msg_id, bool i
             TGL_ERROR("no netsted zip");
             TGL_CRASH();
         }
-        return work_packed(in, msg_id);
+        return work_packed(s, in, msg_id);
     case CODE_bad_server_salt:
-        return work_bad_server_salt(in);
+        return work_bad_server_salt(s, in);
     case CODE_pong:
-        return work_pong(in);
+        return work_pong(s, in);
+    case CODE_future_salts:
+        return work_future_salts(s, in);
     case CODE_msg_detailed_info:
         return work_detailed_info(in);
     case CODE_msg_new_detailed_info:
         return work_new_detailed_info(in);
     case CODE_bad_msg_notification:
-        return work_bad_msg_notification(in);
+        return work_bad_msg_notification(s, in);
     }
     TGL_WARNING("unknown message: " << op);
     in->ptr = in->end; // Will not fail due to assertion in->ptr == in->end
@@ -1296,7 +1708,45 @@ void mtproto_client::restart_session()
     create_session();
 }
 
-bool mtproto_client::process_rpc_message(encrypted_message* enc, int len)
+void mtproto_client::fail_session(struct session& s)
+{
+    if (&s == m_session.get()) {
+        restart_session();
+    } else if (&s == m_media_session.get()) {
+        TGL_WARNING("failing media session " << s.session_id);
+        clear_media_session();
+    }
+}
+
+struct session& mtproto_client::media_session()
+{
+    if (!m_media_session) {
+        m_media_session = std::make_shared<struct session>();
+        while (!m_media_session->session_id) {
+            tgl_secure_random(reinterpret_cast<unsigned char*>(&m_media_session->session_id), 8);
+        }
+        std::weak_ptr<mtproto_client> weak_this(shared_from_this());
+        m_media_session->ev = m_user_agent.timer_factory()->create_timer([weak_this] {
+            if (auto shared_this = weak_this.lock()) {
+                if (shared_this->m_media_session) {
+                    shared_this->send_all_acks(*shared_this->m_media_session);
+                }
+            }
+        });
+        TGL_DEBUG("created media session " << m_media_session->session_id << " for DC " << m_id);
+    }
+    return *m_media_session;
+}
+
+void mtproto_client::clear_media_session()
+{
+    if (m_media_session) {
+        m_media_session->clear();
+        m_media_session.reset();
+    }
+}
+
+bool mtproto_client::process_rpc_message(char* frame, int len)
 {
     const int MINSZ = offsetof(struct encrypted_message, message);
     const int UNENCSZ = offsetof(struct encrypted_message, server_salt);
@@ -1307,52 +1757,55 @@ bool mtproto_client::process_rpc_message(encrypted_message* enc, int len)
     }
     assert(len >= MINSZ && (len & 15) == (UNENCSZ & 15));
 
+    // A frame read in place may start past a 4 byte boundary. The unencrypted header is
+    // moved back to the boundary here and the rest of the message as it is decrypted.
+    size_t misalignment = reinterpret_cast<uintptr_t>(frame) % 4;
+    encrypted_message* enc = reinterpret_cast<encrypted_message*>(frame - misalignment);
+    if (misalignment) {
+        memmove(enc, frame, UNENCSZ);
+    }
+
     if (enc->auth_key_id != m_temp_auth_key_id && enc->auth_key_id != m_auth_key_id) {
         TGL_WARNING("received msg from DC " << m_id << " with auth_key_id " << enc->auth_key_id <<
                 " (perm_auth_key_id " << m_auth_key_id << " temp_auth_key_id "<< m_temp_auth_key_id << "), dropping");
         return true;
     }
 
-    TGLC_aes_key aes_key;
-    unsigned char aes_iv[32];
+    const unsigned char* auth_key;
     if (enc->auth_key_id == m_temp_auth_key_id) {
         assert(enc->auth_key_id == m_temp_auth_key_id);
         assert(m_temp_auth_key_id);
-        tgl_init_aes_auth(&aes_key, aes_iv, m_temp_auth_key.data() + 8, enc->msg_key, AES_DECRYPT);
+        auth_key = m_temp_auth_key.data();
     } else {
         assert(enc->auth_key_id == m_auth_key_id);
         assert(m_auth_key_id);
-        tgl_init_aes_auth(&aes_key, aes_iv, m_auth_key.data() + 8, enc->msg_key, AES_DECRYPT);
+        auth_key = m_auth_key.data();
     }
 
-    int l = tgl_pad_aes_decrypt(&aes_key,
-            aes_iv,
-            reinterpret_cast<const unsigned char*>(&enc->server_salt),
-            len - UNENCSZ,
+    // Checks the message length and the message key as well.
+    int l = TGLC_mtproto_decrypt_message(auth_key + 8, enc->msg_key,
+            reinterpret_cast<const unsigned char*>(frame + UNENCSZ),
             reinterpret_cast<unsigned char*>(&enc->server_salt), len - UNENCSZ);
-    TGL_ASSERT_UNUSED(l, l == len - UNENCSZ);
-
-    if (!(!(enc->msg_len & 3) && enc->msg_len > 0 && enc->msg_len <= len - MINSZ && len - MINSZ - enc->msg_len <= 12)) {
+    if (l < 0) {
         TGL_WARNING("incorrect packet from server, closing connection");
         return false;
     }
     assert(!(enc->msg_len & 3) && enc->msg_len > 0 && enc->msg_len <= len - MINSZ && len - MINSZ - enc->msg_len <= 12);
 
-    if (!m_session || m_session->session_id != enc->session_id) {
+    std::shared_ptr<struct session> s;
+    if (m_session && m_session->session_id == enc->session_id) {
+        s = m_session;
+    } else if (m_media_session && m_media_session->session_id == enc->session_id) {
+        s = m_media_session;
+    } else {
         TGL_WARNING("message to wrong session, dropping");
         return true;
     }
 
-    unsigned char sha1_buffer[20];
-    memset(sha1_buffer, 0, sizeof(sha1_buffer));
-    TGLC_sha1((unsigned char *)&enc->server_salt, enc->msg_len + (MINSZ - UNENCSZ), sha1_buffer);
-    if (memcmp(&enc->msg_key, sha1_buffer + 4, 16)) {
-        TGL_WARNING("incorrect packet from server, closing connection");
-        return false;
-    }
-
     int32_t this_server_time = enc->msg_id >> 32LL;
-    if (!m_session->received_messages) {
+    bool keys_changed = false;
+    if (!s->received_messages) {
+        keys_changed = true;
         m_server_time_delta = this_server_time - tgl_get_system_time();
         if (m_server_time_udelta) {
             TGL_WARNING("adjusting monotonic clock delta to " <<
@@ -1367,14 +1820,21 @@ bool mtproto_client::process_rpc_message(encrypted_message* enc, int len)
                 << ", msg_id = " << enc->msg_id << ", seq_no = " << enc->seq_no
                 << ", server_time = " << server_time << ", time from msg_id = " << this_server_time
                 << ", now = " << static_cast<int64_t>(tgl_get_system_time()));
-        restart_session();
+        fail_session(*s);
         return true;
     }
-    m_session->received_messages++;
+    s->received_messages++;
 
-    if (m_server_salt != enc->server_salt) {
+    // A salt from the cache stays in use until it expires even if the server still uses the
+    // previous one.
+    if (m_server_salt != enc->server_salt && (m_future_salts.empty() || !update_server_salt())) {
         TGL_DEBUG("updating server salt from " << m_server_salt << " to " << enc->server_salt);
         m_server_salt = enc->server_salt;
+        keys_changed = true;
+    }
+
+    if (keys_changed) {
+        store_keys();
     }
 
     TGL_DEBUG("received mesage id " << enc->msg_id);
@@ -1384,12 +1844,12 @@ bool mtproto_client::process_rpc_message(encrypted_message* enc, int len)
     tgl_in_buffer in = { enc->message, enc->message + (enc->msg_len / 4) };
 
     if (enc->msg_id & 1) {
-        insert_msg_id(enc->msg_id);
+        insert_msg_id(*s, enc->msg_id);
     }
-    assert(m_session->session_id == enc->session_id);
+    assert(s->session_id == enc->session_id);
 
-    if (rpc_execute_answer(&in, enc->msg_id) < 0) {
-        restart_session();
+    if (rpc_execute_answer(*s, &in, enc->msg_id) < 0) {
+        fail_session(*s);
         return true;
     }
 
@@ -1407,28 +1867,59 @@ bool mtproto_client::rpc_execute(const std::shared_ptr<tgl_connection>& c, int o
         return true;
     }
 
-    std::unique_ptr<char[]> response(new char[len]);
     TGL_DEBUG("response of " << len << " bytes received from DC " << m_id);
-    int result = c->read(response.get(), len);
+
+    // Frames are decrypted in place in the connection buffer when possible, and only
+    // copied to the scratch buffer when they span several buffers. The scratch buffer
+    // is taken out of the member while it is in use in case we ever get re-entered.
+    if (char* frame = c->read_in_place(len)) {
+        return process_frame(op, frame, len);
+    }
+
+    std::vector<int32_t> buffer = std::move(m_read_buffer);
+    buffer.resize((len + 3) / 4);
+    char* frame = reinterpret_cast<char*>(buffer.data());
+    int result = c->read(frame, len);
     TGL_ASSERT_UNUSED(result, result == len);
 
+    bool success = process_frame(op, frame, len);
+
+    if (buffer.capacity() * 4 <= MAX_RETAINED_READ_BUFFER_SIZE) {
+        m_read_buffer = std::move(buffer);
+    }
+
+    return success;
+}
+
+bool mtproto_client::process_frame(int op, char* response, int len)
+{
     state current_state = m_state;
     if (current_state != state::authorized) {
         TGL_DEBUG("state = " << current_state << " for DC " << m_id);
     }
+
+    // Frames read in place may start past a 4 byte boundary. Encrypted messages are aligned
+    // as they are decrypted, the few other frames are moved back here.
+    size_t misalignment = reinterpret_cast<uintptr_t>(response) % 4;
+    bool rpc_message = current_state == state::authorized && !(op < 0 && op >= -999);
+    if (misalignment && !rpc_message) {
+        memmove(response - misalignment, response, len);
+        response -= misalignment;
+    }
+
     switch (current_state) {
     case state::reqpq_sent:
-        return process_respq_answer(response.get()/* + 8*/, len/* - 12*/, false);
+        return process_respq_answer(response/* + 8*/, len/* - 12*/, false);
     case state::reqdh_sent:
-        return process_dh_answer(response.get()/* + 8*/, len/* - 12*/, false);
+        return process_dh_answer(response/* + 8*/, len/* - 12*/, false);
     case state::client_dh_sent:
-        return process_auth_complete(response.get()/* + 8*/, len/* - 12*/, false);
+        return process_auth_complete(response/* + 8*/, len/* - 12*/, false);
     case state::reqpq_sent_temp:
-        return process_respq_answer(response.get()/* + 8*/, len/* - 12*/, true);
+        return process_respq_answer(response/* + 8*/, len/* - 12*/, true);
     case state::reqdh_sent_temp:
-        return process_dh_answer(response.get()/* + 8*/, len/* - 12*/, true);
+        return process_dh_answer(response/* + 8*/, len/* - 12*/, true);
     case state::client_dh_sent_temp:
-        return process_auth_complete(response.get()/* + 8*/, len/* - 12*/, true);
+        return process_auth_complete(response/* + 8*/, len/* - 12*/, true);
     case state::authorized:
         if (op < 0 && op >= -999) {
             if (m_user_agent.pfs_enabled() && op == -404) {
@@ -1441,7 +1932,7 @@ bool mtproto_client::rpc_execute(const std::shared_ptr<tgl_connection>& c, int o
                 return false;
             }
         } else {
-            return process_rpc_message(reinterpret_cast<encrypted_message*>(response.get()/* + 8*/), len/* - 12*/);
+            return process_rpc_message(response/* + 8*/, len/* - 12*/);
         }
     default:
         TGL_ERROR("cannot receive answer in state " << m_state);
@@ -1453,6 +1944,7 @@ void mtproto_client::restart_temp_authorization()
 {
     TGL_DEBUG("restarting temp authorization for DC " << m_id);
     reset_temp_authorization();
+    store_keys();
     assert(is_authorized());
     if (is_authorized()) {
         m_state = state::authorized;
@@ -1545,6 +2037,9 @@ void mtproto_client::configured(bool success)
         return;
     }
 
+    m_user_agent.warm_up_progress_changed();
+    request_future_salts();
+
     if (this == m_user_agent.active_client().get() || is_logged_in()) {
         TGL_DEBUG("sart sending pending queries if we have");
         send_pending_queries();
@@ -1559,39 +2054,103 @@ void mtproto_client::configured(bool success)
     }
 }
 
-void mtproto_client::send_all_acks()
+void mtproto_client::send_all_acks(struct session& s)
 {
-    if (!is_configured() || !m_session) {
+    if (!is_configured() || !is_current_session(s)) {
         return;
     }
 
-    mtprotocol_serializer s;
-    s.out_i32(CODE_msgs_ack);
-    s.out_i32(CODE_vector);
-    s.out_i32(m_session->ack_set.size());
-    for (int64_t id: m_session->ack_set) {
-        s.out_i64(id);
+    mtprotocol_serializer serializer;
+    serializer.out_i32(CODE_msgs_ack);
+    serializer.out_i32(CODE_vector);
+    serializer.out_i32(s.ack_set.size());
+    for (int64_t id: s.ack_set) {
+        serializer.out_i64(id);
+    }
+    // Without an open media connection the acks wait for the next message in that session.
+    if (send_ack_message(serializer.i32_data(), serializer.i32_size(), &s == m_media_session.get()) != -1) {
+        s.ack_set.clear();
+    } else {
+        s.acks_unsent = true;
     }
-    m_session->ack_set.clear();
-    send_ack_message(s.i32_data(), s.i32_size());
 }
 
-void mtproto_client::insert_msg_id(int64_t id)
+void mtproto_client::insert_msg_id(struct session& s, int64_t id)
 {
-    if (!m_session || !m_session->ev) {
+    if (!s.ev) {
         return;
     }
 
-    if (m_session->ack_set.empty()) {
-        m_session->ev->start(ACK_TIMEOUT);
+    if (s.ack_set.empty() || s.acks_unsent) {
+        s.acks_unsent = false;
+        s.ev->start(ACK_TIMEOUT);
     }
-    m_session->ack_set.insert(id);
+    s.ack_set.insert(id);
+}
+
+void mtproto_client::store_keys()
+{
+    const auto& storage = m_user_agent.dc_key_storage();
+    if (!storage || !is_authorized() || !m_auth_key_id) {
+        return;
+    }
+
+    tgl_dc_keys keys;
+    keys.dc_id = m_id;
+    keys.auth_key = m_auth_key;
+    if (is_bound() && m_temp_auth_key_id != m_auth_key_id && m_temp_auth_key_expires) {
+        keys.temp_auth_key = m_temp_auth_key;
+        keys.temp_auth_key_expires = m_temp_auth_key_expires;
+    }
+    keys.server_salt = m_server_salt;
+    keys.future_salts.assign(m_future_salts.begin(), m_future_salts.end());
+    keys.server_time_delta = m_server_time_delta;
+    storage->store_keys(keys);
+}
+
+void mtproto_client::restore_keys()
+{
+    const auto& storage = m_user_agent.dc_key_storage();
+    if (!storage || m_temp_auth_key_id) {
+        return;
+    }
+
+    auto keys = storage->load_keys(m_id);
+    if (!keys) {
+        return;
+    }
+
+    if (!is_authorized() || !m_auth_key_id) {
+        set_auth_key(keys->auth_key.data(), keys->auth_key.size());
+    } else if (keys->auth_key != m_auth_key) {
+        TGL_DEBUG("stored keys of DC " << m_id << " are for another auth key, ignoring them");
+        return;
+    }
+
+    m_server_time_delta = keys->server_time_delta;
+    m_server_time_udelta = tgl_get_system_time() + m_server_time_delta - tgl_get_monotonic_time();
+    m_server_salt = keys->server_salt;
+
+    if (m_user_agent.pfs_enabled() && keys->temp_auth_key_expires > get_server_time() + MIN_RESTORED_TEMP_KEY_LIFETIME) {
+        m_temp_auth_key = keys->temp_auth_key;
+        calculate_auth_key_id(true);
+        m_temp_auth_key_expires = keys->temp_auth_key_expires;
+        set_bound();
+    }
+
+    // The salts belong to the key the messages are encrypted with.
+    if (!m_user_agent.pfs_enabled() || is_bound()) {
+        m_future_salts.assign(keys->future_salts.begin(), keys->future_salts.end());
+    }
+
+    TGL_DEBUG("restored keys of DC " << m_id << (is_bound() ? " with" : " without") << " a temp key");
 }
 
 void mtproto_client::create_session()
 {
     assert(!m_session);
-    m_session = std::make_unique<struct session>();
+    restore_keys();
+    m_session = std::make_shared<struct session>();
     while (!m_session->session_id) {
         tgl_secure_random(reinterpret_cast<unsigned char*>(&m_session->session_id), 8);
     }
@@ -1604,7 +2163,9 @@ void mtproto_client::create_session()
     m_session->primary_worker->connection->open();
     m_session->ev = m_user_agent.timer_factory()->create_timer([weak_this] {
         if (auto shared_this = weak_this.lock()) {
-            shared_this->send_all_acks();
+            if (shared_this->m_session) {
+                shared_this->send_all_acks(*shared_this->m_session);
+            }
         }
     });
 }
@@ -1615,6 +2176,9 @@ void mtproto_client::reset_authorization()
     m_state = state::init;
     memset(m_auth_key.data(), 0, m_auth_key.size());
     m_auth_key_id = 0;
+    if (const auto& storage = m_user_agent.dc_key_storage()) {
+        storage->remove_keys(m_id);
+    }
 }
 
 void mtproto_client::reset_temp_authorization()
@@ -1626,7 +2190,9 @@ void mtproto_client::reset_temp_authorization()
     memset(m_new_nonce.data(), 0, m_new_nonce.size());
     memset(m_server_nonce.data(), 0, m_server_nonce.size());
     m_temp_auth_key_id = 0;
+    m_temp_auth_key_expires = 0;
     m_server_salt = 0;
+    clear_future_salts();
     set_configured(false);
     set_bound(false);
 }
@@ -1643,21 +2209,34 @@ void mtproto_client::send_pending_queries()
     }
 }
 
-void mtproto_client::increase_active_queries(size_t num)
+bool mtproto_client::add_active_query(const std::shared_ptr<query>& q)
 {
-    m_active_queries += num;
+    if (!m_active_queries.insert_or_assign(q->msg_id(), q)) {
+        return false;
+    }
+
     if (m_session_cleanup_timer) {
         m_session_cleanup_timer->cancel();
     }
+    return true;
 }
 
-void mtproto_client::decrease_active_queries(size_t num)
+std::shared_ptr<query> mtproto_client::active_query(int64_t msg_id) const
 {
-    if (m_active_queries >= num) {
-        m_active_queries -= num;
+    const auto* q = m_active_queries.find(msg_id);
+    return q ? *q : nullptr;
+}
+
+bool mtproto_client::remove_active_query(const std::shared_ptr<query>& q)
+{
+    const auto* active = m_active_queries.find(q->msg_id());
+    if (!active || *active != q) {
+        return false;
     }
+    m_active_queries.erase(q->msg_id());
 
-    if (!m_active_queries && m_pending_queries.empty() && m_user_agent.active_client().get() != this) {
+    if (m_active_queries.empty() && m_pending_queries.empty() && m_user_agent.active_client().get() != this
+            && !m_user_agent.is_warm_up_dc(m_id)) {
         if (!m_session_cleanup_timer) {
             std::weak_ptr<mtproto_client> weak_this(shared_from_this());
             m_session_cleanup_timer = m_user_agent.timer_factory()->create_timer([weak_this] {
@@ -1668,6 +2247,7 @@ void mtproto_client::decrease_active_queries(size_t num)
         }
         m_session_cleanup_timer->start(SESSION_CLEANUP_TIMEOUT);
     }
+    return true;
 }
 
 void mtproto_client::add_pending_query(const std::shared_ptr<query>& q)
@@ -1684,7 +2264,7 @@ void mtproto_client::remove_pending_query(const std::shared_ptr<query>& q)
 
 void mtproto_client::cleanup_timer_expired()
 {
-    if (!m_active_queries && m_pending_queries.empty()) {
+    if (m_active_queries.empty() && m_pending_queries.empty() && !m_user_agent.is_warm_up_dc(m_id)) {
         TGL_DEBUG("cleanup timer expired for DC " << m_id << ", deleting session");
         clear_session();
     }
@@ -1728,11 +2308,13 @@ void mtproto_client::connection_status_changed(const std::shared_ptr<tgl_connect
     }
 
     if (c != m_session->primary_worker->connection) {
-        if (c->status() == tgl_connection_status::closed) {
-            auto it = m_session->secondary_workers.begin();
-            for (; it != m_session->secondary_workers.end(); ++it) {
+        if (c->status() == tgl_connection_status::closed && m_media_session) {
+            auto it = m_media_session->secondary_workers.begin();
+            for (; it != m_media_session->secondary_workers.end(); ++it) {
                 if ((*it)->connection == c) {
-                    m_session->secondary_workers.erase(it);
+                    auto w = *it;
+                    m_media_session->secondary_workers.erase(it);
+                    flush_queued_messages(*m_media_session, w);
                     break;
                 }
             }
@@ -1811,7 +2393,7 @@ void mtproto_client::transfer_auth_to_me()
 
 size_t mtproto_client::max_connections() const
 {
-    return MAX_SECONDARY_WORKERS_PER_SESSION + 1;
+    return m_user_agent.max_secondary_connections() + 1;
 }
 
 tgl_online_status mtproto_client::online_status() const
@@ -23,13 +23,18 @@
 #pragma once
 
 #include "crypto/crypto_bn.h"
+#include "gzip_inflater.h"
+#include "msg_id_map.h"
 #include "session.h"
 #include "tgl/tgl_mtproto_client.h"
 #include "tgl/tgl_dc.h"
+#include "tgl/tgl_dc_key_storage.h"
+#include "tgl/tgl_net.h"
 #include "user_agent.h"
 
 #include <array>
 #include <cassert>
+#include <deque>
 #include <iostream>
 #include <list>
 #include <memory>
@@ -103,10 +108,21 @@ public:
     virtual const std::array<unsigned char, 256>& auth_key() const override { return m_auth_key; }
     virtual double time_difference() const override { return m_server_time_delta; }
 
-    struct session* session() const { return m_session.get(); }
+    // The session file transfers are sent in, which is the main session unless a media session is open.
+    struct session* session(bool file_transfer = false) const
+    {
+        return file_transfer && m_media_session ? m_media_session.get() : m_session.get();
+    }
+
+    bool has_session(int64_t session_id) const
+    {
+        return session_id && ((m_session && m_session->session_id == session_id)
+                || (m_media_session && m_media_session->session_id == session_id));
+    }
 
     void clear_session()
     {
+        clear_media_session();
         if (m_session) {
             m_session->clear();
             m_session.reset();
@@ -115,18 +131,24 @@ public:
 
     void create_session();
 
+    // A file transfer goes out in the main session when no media connection is available,
+    // so sent_session tells which session the message was actually sent in.
     int64_t send_message(const int32_t* message, size_t message_ints,
-            int64_t message_id_override, bool force_send, bool allow_secondary_connections)
+            int64_t message_id_override, bool force_send, bool file_transfer,
+            const struct session** sent_session = nullptr)
     {
-        return send_message_impl(message, message_ints, message_id_override, force_send, true, allow_secondary_connections, true);
+        return send_message_impl(message, message_ints, message_id_override, force_send, true, file_transfer, true, sent_session);
     }
 
     void reset_authorization();
     void restart_authorization();
     void restart_temp_authorization();
 
-    void increase_active_queries(size_t num = 1);
-    void decrease_active_queries(size_t num = 1);
+    // Returns false if a query with the same msg_id was already active, in which case it is replaced.
+    bool add_active_query(const std::shared_ptr<query>& q);
+    std::shared_ptr<query> active_query(int64_t msg_id) const;
+    bool remove_active_query(const std::shared_ptr<query>& q);
+    void clear_active_queries() { m_active_queries.clear(); }
 
     void add_pending_query(const std::shared_ptr<query>& q);
     void remove_pending_query(const std::shared_ptr<query>& q);
@@ -149,6 +171,8 @@ public:
     bool is_logging_out() const { return !!m_logout_query; }
 
     void set_auth_key(const unsigned char* key, size_t length);
+    // Saves the keys, salt and time delta to the user agent's tgl_dc_key_storage, if there is one.
+    void store_keys();
 
     void add_ipv6_option(const std::string& address, int port);
     void add_ipv4_option(const std::string& address, int port);
@@ -166,46 +190,57 @@ public:
 
     size_t max_connections() const;
 
+    gzip_inflater& inflater() { return m_inflater; }
+
 private:
     void connected(bool pfs_enabled, int32_t temp_key_expire_time);
     void configured(bool success);
     void reset_temp_authorization();
     void cleanup_timer_expired();
-    void send_all_acks();
+    void send_all_acks(struct session& s);
     int64_t generate_next_msg_id();
     double get_server_time();
     void create_temp_auth_key();
     void restart_session();
+    void fail_session(struct session& s);
+    bool is_current_session(const struct session& s) const { return &s == m_session.get() || &s == m_media_session.get(); }
+    struct session& media_session();
+    void clear_media_session();
     void rpc_send_packet(const char* data, size_t len);
+    void rpc_send_frame(const std::shared_ptr<tgl_connection>& c, std::vector<char>&& frame);
+    void send_unsent_frames();
     void send_req_pq_packet();
     void send_req_pq_temp_packet();
     int encrypt_inner_temp(const int32_t* msg, int msg_ints, void* data, int64_t msg_id);
     void send_req_dh_packet(TGLC_bn_ctx* ctx, TGLC_bn* pq, bool temp_key, int32_t temp_key_expire_time);
     void send_dh_params(TGLC_bn_ctx* ctx, TGLC_bn* dh_prime, TGLC_bn* g_a, int g, bool temp_key);
     void bind_temp_auth_key(int32_t temp_key_expire_time);
-    void init_enc_msg(encrypted_message& enc_msg, bool useful);
+    int32_t generate_next_seq_no(struct session& s, bool useful);
+    void init_enc_msg(const struct session& s, encrypted_message& enc_msg, int64_t msg_id, int32_t seq_no);
     void init_enc_msg_inner_temp(encrypted_message& enc_msg, int64_t msg_id);
     void restart_authorization(bool temp_key);
-    int rpc_execute_answer(tgl_in_buffer* in, int64_t msg_id, bool in_gzip = false);
-    int work_container(tgl_in_buffer* in, int64_t msg_id);
-    int work_new_session_created(tgl_in_buffer* in, int64_t msg_id);
-    int work_packed(tgl_in_buffer* in, int64_t msg_id);
-    int work_bad_server_salt(tgl_in_buffer* in);
-    int work_rpc_result(tgl_in_buffer* in, int64_t msg_id);
-    int work_pong(tgl_in_buffer* in);
-    int work_bad_msg_notification(tgl_in_buffer* in);
+    int rpc_execute_answer(struct session& s, tgl_in_buffer* in, int64_t msg_id, bool in_gzip = false);
+    int work_container(struct session& s, tgl_in_buffer* in, int64_t msg_id);
+    int work_new_session_created(const struct session& s, tgl_in_buffer* in, int64_t msg_id);
+    int work_packed(struct session& s, tgl_in_buffer* in, int64_t msg_id);
+    int work_bad_server_salt(const struct session& s, tgl_in_buffer* in);
+    int work_rpc_result(struct session& s, tgl_in_buffer* in, int64_t msg_id);
+    int work_pong(struct session& s, tgl_in_buffer* in);
+    int work_future_salts(struct session& s, tgl_in_buffer* in);
+    int work_bad_msg_notification(const struct session& s, tgl_in_buffer* in);
     int work_msgs_ack(tgl_in_buffer* in, int64_t msg_id);
     int query_error(tgl_in_buffer* in, int64_t id);
     int query_result(tgl_in_buffer* in, int64_t id);
-    void insert_msg_id(int64_t id);
+    void insert_msg_id(struct session& s, int64_t id);
     void calculate_auth_key_id(bool temp_key);
     bool rpc_execute(const std::shared_ptr<tgl_connection>& c, int op, int len);
+    bool process_frame(int op, char* frame, int len);
     bool process_respq_answer(const char* packet, int len, bool temp_key);
     bool process_dh_answer(const char* packet, int len, bool temp_key);
     bool process_auth_complete(const char* packet, int len, bool temp_key);
-    bool process_rpc_message(encrypted_message* enc, int len);
-    void regen_query(int64_t msg_id);
-    void restart_query(int64_t msg_id);
+    bool process_rpc_message(char* frame, int len);
+    void regen_query(const struct session& s, int64_t msg_id);
+    void restart_query(const struct session& s, int64_t msg_id);
     void ack_query(int64_t msg_id);
 
     int64_t send_message(const int32_t* message, size_t message_ints)
@@ -213,24 +248,49 @@ private:
         return send_message_impl(message, message_ints, 0, false, false, false, true);
     }
 
-    int64_t send_ack_message(const int32_t* message, size_t message_ints)
+    int64_t send_ack_message(const int32_t* message, size_t message_ints, bool file_transfer)
     {
-        return send_message_impl(message, message_ints, 0, false, false, false, false);
+        return send_message_impl(message, message_ints, 0, false, false, file_transfer, false);
     }
 
     int64_t send_message_impl(const int32_t* msg, size_t msg_ints,
-            int64_t msg_id_override, bool force_send, bool useful, bool allow_secondary_connections, bool count_work_load);
-
-    std::shared_ptr<worker> select_best_worker(bool allow_secondary_workers);
-    void worker_job_done(int64_t id);
+            int64_t msg_id_override, bool force_send, bool useful, bool file_transfer, bool count_work_load,
+            const struct session** sent_session = nullptr);
+
+    void send_encrypted_message(const struct session& s, const std::shared_ptr<worker>& w,
+            const int32_t* msg, size_t msg_ints, int64_t msg_id, int32_t seq_no);
+    void queue_message(struct session& s, const std::shared_ptr<worker>& w,
+            const int32_t* msg, size_t msg_ints, int64_t msg_id, int32_t seq_no);
+    void flush_queued_messages(struct session& s, const std::shared_ptr<worker>& w);
+    void move_queued_messages(struct session& s, const std::shared_ptr<worker>& stopped,
+            std::vector<int32_t>&& messages, std::vector<int64_t>&& msg_ids);
+    void flush_all_queued_messages(struct session& s);
+    const std::vector<int64_t>* sent_container_msg_ids(const struct session& s, int64_t msg_id) const;
+
+    std::shared_ptr<worker> select_best_worker(struct session& s, bool new_job);
+    std::shared_ptr<worker> start_media_worker(struct session& s);
+    void worker_job_started(struct session& s, const std::shared_ptr<worker>& w, int64_t id, size_t bytes);
+    void worker_job_done(struct session& s, int64_t id);
 
     void clear_bind_temp_auth_key_query();
+    void restore_keys();
+
+    void request_future_salts();
+    void schedule_future_salts_request(double timeout);
+    void clear_future_salts();
+    // Switches to the newest cached salt which is already valid. Returns false if
+    // no cached salt is valid now.
+    bool update_server_salt();
 
 private:
     user_agent& m_user_agent;
     int32_t m_id;
     state m_state;
-    std::unique_ptr<struct session> m_session;
+    // Held as shared pointers so that a session cleared while one of its messages is being
+    // handled stays valid until the handling is done.
+    std::shared_ptr<struct session> m_session;
+    std::shared_ptr<struct session> m_media_session;
+    int64_t m_last_msg_id;
     std::array<unsigned char, 256> m_auth_key;
     std::array<unsigned char, 256> m_temp_auth_key;
     std::array<unsigned char, 16> m_nonce;
@@ -238,7 +298,10 @@ private:
     std::array<unsigned char, 32> m_new_nonce;
     int64_t m_auth_key_id;
     int64_t m_temp_auth_key_id;
+    int64_t m_temp_auth_key_expires;
     int64_t m_server_salt;
+    std::deque<tgl_future_salt> m_future_salts;
+    std::shared_ptr<tgl_timer> m_future_salts_timer;
 
     int64_t m_server_time_delta;
     double m_server_time_udelta;
@@ -248,7 +311,7 @@ private:
     std::vector<std::pair<std::string, int>> m_ipv6_options;
     std::vector<std::pair<std::string, int>> m_ipv4_options;
 
-    size_t m_active_queries;
+    msg_id_map<std::shared_ptr<query>> m_active_queries;
     bool m_authorized;
     bool m_logged_in;
     bool m_configured;
@@ -259,7 +322,11 @@ private:
     std::shared_ptr<query> m_bind_temp_auth_key_query;
 
     std::shared_ptr<tgl_timer> m_session_cleanup_timer;
+    std::vector<std::pair<std::shared_ptr<tgl_connection>, std::vector<tgl_write_buffer>>> m_unsent_frames;
+    std::shared_ptr<tgl_timer> m_send_frames_timer;
     std::shared_ptr<rsa_public_key> m_rsa_key;
+    std::vector<int32_t> m_read_buffer;
+    gzip_inflater m_inflater;
     std::set<std::weak_ptr<connection_status_observer>, std::owner_less<std::weak_ptr<connection_status_observer>>> m_connection_status_observers;
 };
 
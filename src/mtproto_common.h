@@ -45,6 +45,7 @@
 #define INT64_PRINTF_MODIFIER "ll"
 #endif
 
+#include "tl_ds_arena.h"
 #include "tools.h"
 #include "tgl/tgl_log.h"
 
@@ -167,6 +168,13 @@ public:
     }
 
     void out_string(const char* str, size_t size)
+    {
+        memcpy(out_string_buffer(size), str, size);
+    }
+
+    // Appends a string of size bytes and returns where the bytes go, for the caller to fill
+    // in. The pointer is valid until something else is appended.
+    char* out_string_buffer(size_t size)
     {
         if (size >= (1 << 24)) {
             throw std::invalid_argument("string is too big");
@@ -185,11 +193,11 @@ public:
             dest += 4;
         }
 
-        memcpy(dest, str, size);
-        dest += size;
-        while (dest < reinterpret_cast<char*>(m_data.data() + m_data.size())) {
-            *dest++ = 0;
+        char* padding = dest + size;
+        while (padding < reinterpret_cast<char*>(m_data.data() + m_data.size())) {
+            *padding++ = 0;
         }
+        return dest;
     }
 
     void out_string(const char* str)
@@ -254,6 +262,9 @@ struct tgl_in_buffer {
     const int32_t* ptr;
     const int32_t* end;
 
+    // When set, fetch_ds_* decodes into this arena instead of the heap.
+    tl_ds_arena* arena = nullptr;
+
     std::string print_buffer()
     {
         std::stringstream ss;
@@ -294,6 +305,34 @@ static inline const char* fetch_str(struct tgl_in_buffer* in, size_t len)
     }
 }
 
+static inline void* tl_ds_malloc(struct tgl_in_buffer* in, size_t size)
+{
+    return in->arena ? in->arena->allocate(size) : malloc(size);
+}
+
+static inline void* tl_ds_calloc(struct tgl_in_buffer* in, size_t size)
+{
+    if (in->arena) {
+        void* result = in->arena->allocate(size);
+        memset(result, 0, size);
+        return result;
+    }
+    return calloc(1, size);
+}
+
+static inline char* fetch_ds_str(struct tgl_in_buffer* in, size_t len)
+{
+    const char* str = fetch_str(in, len);
+    if (in->arena && in->arena->string_views()) {
+        // The buffers we decode from are always our own writable memory.
+        return const_cast<char*>(str);
+    }
+    char* result = static_cast<char*>(tl_ds_malloc(in, len + 1));
+    memcpy(result, str, len);
+    result[len] = 0;
+    return result;
+}
+
 static inline void fetch_skip(struct tgl_in_buffer* in, size_t n)
 {
     in->ptr += n;
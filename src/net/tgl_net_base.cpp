@@ -24,6 +24,8 @@
 #include <tgl/tgl_mtproto_client.h>
 #include <tgl/tgl_connection_status.h>
 
+#include <algorithm>
+
 // This is a default base implementation of tgl_connection. It should include the public headers only.
 
 constexpr std::chrono::seconds PING_CHECK_DURATION(10);
@@ -33,6 +35,51 @@ constexpr std::chrono::milliseconds MAX_RESTART_DURATION(59000); // a little bit
 constexpr std::chrono::milliseconds PING_DURATION(30000);
 constexpr std::chrono::milliseconds PING_FAIL_DURATION(60000);
 
+constexpr size_t MIN_READ_BUFFER_SIZE = 16 * 1024;
+constexpr size_t MAX_RETAINED_READ_BUFFER_SIZE = 1024 * 1024;
+// Buffers up to this size are copied together when written in a batch.
+constexpr size_t MAX_GATHERED_WRITE_SIZE = 16 * 1024;
+
+char* tgl_net_read_buffer::reserve(size_t min_size)
+{
+    if (free_size() >= min_size) {
+        return m_data.data() + m_end;
+    }
+
+    size_t unread = size();
+    if (!m_pin_count && unread + min_size <= m_data.size()) {
+        std::memmove(m_data.data(), data(), unread);
+    } else {
+        size_t new_size = std::max(std::max(unread + min_size, MIN_READ_BUFFER_SIZE), m_data.size() * 2);
+        std::vector<char> new_data(new_size);
+        std::memcpy(new_data.data(), data(), unread);
+        std::swap(m_data, new_data);
+        if (m_pin_count) {
+            m_retired_data.push_back(std::move(new_data));
+        }
+    }
+
+    m_begin = 0;
+    m_end = unread;
+    return m_data.data() + m_end;
+}
+
+void tgl_net_read_buffer::unpin()
+{
+    assert(m_pin_count > 0);
+    if (--m_pin_count) {
+        return;
+    }
+
+    m_retired_data.clear();
+    if (empty()) {
+        m_begin = m_end = 0;
+        if (m_data.size() > MAX_RETAINED_READ_BUFFER_SIZE) {
+            m_data = std::vector<char>();
+        }
+    }
+}
+
 tgl_connection_base::tgl_connection_base(
         const std::vector<std::pair<std::string, int>>& ipv4_options,
         const std::vector<std::pair<std::string, int>>& ipv6_options,
@@ -43,7 +90,8 @@ tgl_connection_base::tgl_connection_base(
     , m_restart_timer()
     , m_last_restart_time()
     , m_restart_duration(MIN_RESTART_DURATION)
-    , m_available_bytes_for_read(0)
+    , m_read_buffer()
+    , m_consume_depth(0)
     , m_mtproto_client(weak_client)
     , m_online_status(tgl_online_status::not_online)
     , m_connection_status(tgl_connection_status::disconnected)
@@ -115,33 +163,13 @@ void tgl_connection_base::start_ping_timer()
 
 ssize_t tgl_connection_base::peek(void* data_out, size_t len)
 {
-    unsigned char* data = static_cast<unsigned char*>(data_out);
-    if (!len || !m_available_bytes_for_read) {
+    len = std::min(len, m_read_buffer.size());
+    if (!len) {
         return 0;
     }
-    assert(len > 0);
-    if (len > m_available_bytes_for_read) {
-        len = m_available_bytes_for_read;
-    }
-
-    int read_bytes = 0;
-    size_t i = 0;
-    auto buffer = m_read_buffer_queue[i];
-    while (len) {
-        size_t buffer_size = buffer->size();
-        if (buffer_size >= len) {
-            memcpy(data, buffer->data(), len);
-            return read_bytes + len;
-        } else {
-            memcpy(data, buffer->data(), buffer_size);
-            read_bytes += buffer_size;
-            data += buffer_size;
-            len -= buffer_size;
-            buffer = m_read_buffer_queue[++i];
-        }
-    }
 
-    return read_bytes;
+    memcpy(data_out, m_read_buffer.data(), len);
+    return len;
 }
 
 void tgl_connection_base::open()
@@ -294,7 +322,15 @@ void tgl_connection_base::consume_data()
         return;
     }
 
-    if (!client->try_rpc_execute(shared_from_this()) && m_state != connection_state::closed) {
+    // Frames are processed in place in the read buffer, which must not move them
+    // even if more data is received while they are processed.
+    m_read_buffer.pin();
+    ++m_consume_depth;
+    bool success = client->try_rpc_execute(shared_from_this());
+    --m_consume_depth;
+    m_read_buffer.unpin();
+
+    if (!success && m_state != connection_state::closed) {
         set_state(connection_state::failed);
         schedule_restart();
     }
@@ -330,70 +366,72 @@ void tgl_connection_base::close_internal(bool call_disconnect)
 void tgl_connection_base::clear_buffers()
 {
     m_write_buffer_queue.clear();
-    m_read_buffer_queue.clear();
-    m_available_bytes_for_read = 0;
+    m_read_buffer.clear();
 }
 
 void tgl_connection_base::data_received(const std::shared_ptr<tgl_net_buffer>& buffer)
 {
-    bytes_received(buffer->size());
+    memcpy(receive_buffer(buffer->size()), buffer->data(), buffer->size());
+    data_received(buffer->size());
+}
+
+void tgl_connection_base::data_received(size_t bytes)
+{
+    bytes_received(bytes);
 
     if (m_state == connection_state::closed) {
         TGL_WARNING("invalid read from closed connection");
         return;
     }
 
-    TGL_DEBUG("received " << buffer->size() << " bytes from mtproto_client " << client_id());
+    TGL_DEBUG("received " << bytes << " bytes from mtproto_client " << client_id());
 
-    if (buffer->size() > 0) {
-        m_last_receive_time = std::chrono::steady_clock::now();
-        stop_ping_timer();
-        start_ping_timer();
-        m_read_buffer_queue.push_back(buffer);
+    if (!bytes) {
+        return;
     }
 
-    m_available_bytes_for_read += buffer->size();
-    if (m_read_buffer_queue.size()) {
-        consume_data();
+    if (m_read_buffer.free_size() < bytes) {
+        assert(false);
+        return;
     }
+
+    m_last_receive_time = std::chrono::steady_clock::now();
+    stop_ping_timer();
+    start_ping_timer();
+
+    m_read_buffer.commit(bytes);
+    consume_data();
 }
 
 ssize_t tgl_connection_base::read(void* data_out, size_t len)
 {
-    unsigned char* data = static_cast<unsigned char*>(data_out);
+    len = std::min(len, m_read_buffer.size());
     if (!len) {
         return 0;
     }
 
-    assert(len > 0);
-    if (len > m_available_bytes_for_read) {
-        len = m_available_bytes_for_read;
+    memcpy(data_out, m_read_buffer.data(), len);
+    m_read_buffer.consume(len);
+    return len;
+}
+
+char* tgl_connection_base::read_in_place(size_t len)
+{
+    if (!len || m_read_buffer.size() < len) {
+        return nullptr;
     }
 
-    size_t read_bytes = 0;
-    auto buffer = m_read_buffer_queue.front();
-    while (len) {
-        size_t buffer_size = buffer->size();
-        if (buffer_size >= len) {
-            memcpy(data, buffer->data(), len);
-            buffer->advance(len);
-            if (buffer->empty()) {
-                m_read_buffer_queue.pop_front();
-            }
-            m_available_bytes_for_read -= len;
-            return read_bytes + len;
-        } else {
-            memcpy(data, buffer->data(), buffer_size);
-            m_available_bytes_for_read -= buffer_size;
-            read_bytes += buffer_size;
-            data += buffer_size;
-            len -= buffer_size;
-            m_read_buffer_queue.pop_front();
-            buffer = m_read_buffer_queue.front();
-        }
+    // The frame usually follows a one byte length prefix. The caller aligns it as it
+    // processes it, over the bytes already consumed, unless those bytes may still be
+    // in use further up the stack.
+    char* data = m_read_buffer.data();
+    size_t misalignment = reinterpret_cast<uintptr_t>(data) % 4;
+    if (misalignment && (m_consume_depth > 1 || m_read_buffer.consumed_size() < misalignment)) {
+        return nullptr;
     }
 
-    return read_bytes;
+    m_read_buffer.consume(len);
+    return data;
 }
 
 ssize_t tgl_connection_base::write(const void* data, size_t len)
@@ -403,12 +441,61 @@ ssize_t tgl_connection_base::write(const void* data, size_t len)
     }
 
     m_write_buffer_queue.push_back(std::make_shared<tgl_net_buffer>(static_cast<const char*>(data), len));
-    try_write();
     return len;
 }
 
+ssize_t tgl_connection_base::write_buffer(std::vector<char>&& data, size_t offset)
+{
+    assert(offset <= data.size());
+    size_t len = data.size() - offset;
+    if (!len) {
+        return 0;
+    }
+
+    m_write_buffer_queue.push_back(std::make_shared<tgl_net_buffer>(std::move(data), offset));
+    return len;
+}
+
+ssize_t tgl_connection_base::writev(std::vector<tgl_write_buffer>&& buffers)
+{
+    // Runs of small buffers are gathered into one queued buffer. Large ones are taken over as
+    // they are, copying them would cost more than the allocation it saves.
+    ssize_t written = 0;
+    size_t i = 0;
+    while (i < buffers.size()) {
+        size_t end = i;
+        size_t total_len = 0;
+        while (end < buffers.size() && buffers[end].data.size() - buffers[end].offset < MAX_GATHERED_WRITE_SIZE) {
+            total_len += buffers[end].data.size() - buffers[end].offset;
+            ++end;
+        }
+
+        if (end - i < 2) {
+            written += write_buffer(std::move(buffers[i].data), buffers[i].offset);
+            ++i;
+            continue;
+        }
+
+        auto gathered = std::make_shared<tgl_net_buffer>(total_len);
+        char* data = gathered->data();
+        for (; i < end; ++i) {
+            size_t len = buffers[i].data.size() - buffers[i].offset;
+            memcpy(data, buffers[i].data.data() + buffers[i].offset, len);
+            data += len;
+        }
+        if (total_len) {
+            m_write_buffer_queue.push_back(std::move(gathered));
+        }
+        written += total_len;
+    }
+    return written;
+}
+
 void tgl_connection_base::flush()
 {
+    if (!m_write_buffer_queue.empty()) {
+        try_write();
+    }
 }
 
 void tgl_connection_base::on_online_status_changed(tgl_online_status status)
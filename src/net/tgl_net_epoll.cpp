@@ -0,0 +1,458 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include <tgl/impl/tgl_net_epoll.h>
+
+#include <tgl/tgl_log.h>
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// This is a reference implementation of tgl_connection and tgl_timer_factory. It should include the public headers only.
+
+constexpr int MAX_EPOLL_EVENTS = 64;
+constexpr size_t MIN_RECEIVE_SIZE = 64 * 1024;
+constexpr size_t MAX_WRITE_IOVECS = 64;
+constexpr uint64_t TIMER_FD_TOKEN = 0;
+
+tgl_epoll_loop::tgl_epoll_loop()
+    : m_epoll_fd(epoll_create1(EPOLL_CLOEXEC))
+    , m_timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    , m_stopped(false)
+    , m_next_token(TIMER_FD_TOKEN + 1)
+{
+    if (m_epoll_fd < 0 || m_timer_fd < 0) {
+        throw std::runtime_error(std::string("failed to create the event loop: ") + strerror(errno));
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = TIMER_FD_TOKEN;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_timer_fd, &event) < 0) {
+        throw std::runtime_error(std::string("failed to watch the timerfd: ") + strerror(errno));
+    }
+}
+
+tgl_epoll_loop::~tgl_epoll_loop()
+{
+    ::close(m_timer_fd);
+    ::close(m_epoll_fd);
+}
+
+double tgl_epoll_loop::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void tgl_epoll_loop::run()
+{
+    m_stopped = false;
+    while (!m_stopped) {
+        run_once(-1);
+    }
+}
+
+void tgl_epoll_loop::run_once(double timeout)
+{
+    arm_timer_fd();
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int timeout_ms = timeout < 0 ? -1 : static_cast<int>(timeout * 1000);
+    int n = epoll_wait(m_epoll_fd, events, MAX_EPOLL_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) {
+            TGL_ERROR("epoll_wait failed: " << strerror(errno));
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        uint64_t token = events[i].data.u64;
+        if (token == TIMER_FD_TOKEN) {
+            uint64_t expirations;
+            ssize_t result = read(m_timer_fd, &expirations, sizeof(expirations));
+            (void)result;
+            continue;
+        }
+
+        // A handler may remove itself or other handlers of the same batch.
+        auto it = m_handlers.find(token);
+        if (it == m_handlers.end()) {
+            continue;
+        }
+        std::shared_ptr<event_handler> handler = it->second;
+        (*handler)(events[i].events);
+    }
+
+    run_expired_timers();
+}
+
+bool tgl_epoll_loop::add_fd(int fd, uint32_t events, const event_handler& handler)
+{
+    uint64_t token = m_next_token++;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u64 = token;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        TGL_ERROR("failed to watch fd " << fd << ": " << strerror(errno));
+        return false;
+    }
+
+    m_handlers[token] = std::make_shared<event_handler>(handler);
+    m_fd_tokens[fd] = token;
+    return true;
+}
+
+void tgl_epoll_loop::remove_fd(int fd)
+{
+    auto it = m_fd_tokens.find(fd);
+    if (it == m_fd_tokens.end()) {
+        return;
+    }
+
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    m_handlers.erase(it->second);
+    m_fd_tokens.erase(it);
+}
+
+uint64_t tgl_epoll_loop::schedule(double deadline, const std::function<void()>& callback)
+{
+    uint64_t timer_id = m_next_token++;
+    m_timers.emplace(std::make_pair(deadline, timer_id), callback);
+    m_timer_deadlines[timer_id] = deadline;
+    return timer_id;
+}
+
+void tgl_epoll_loop::cancel(uint64_t timer_id)
+{
+    auto it = m_timer_deadlines.find(timer_id);
+    if (it == m_timer_deadlines.end()) {
+        return;
+    }
+
+    m_timers.erase(std::make_pair(it->second, timer_id));
+    m_timer_deadlines.erase(it);
+}
+
+void tgl_epoll_loop::arm_timer_fd()
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (!m_timers.empty()) {
+        double deadline = m_timers.begin()->first.first;
+        spec.it_value.tv_sec = static_cast<time_t>(deadline);
+        // Round up, so the deadline has passed when the timer fires.
+        spec.it_value.tv_nsec = static_cast<long>(std::ceil((deadline - spec.it_value.tv_sec) * 1e9));
+        if (spec.it_value.tv_nsec >= 1000000000) {
+            spec.it_value.tv_sec += 1;
+            spec.it_value.tv_nsec -= 1000000000;
+        }
+        // An all zero value would disarm the timer instead of firing it right away.
+        if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void tgl_epoll_loop::run_expired_timers()
+{
+    double current_time = now();
+    while (!m_timers.empty() && m_timers.begin()->first.first <= current_time) {
+        auto it = m_timers.begin();
+        std::function<void()> callback = std::move(it->second);
+        m_timer_deadlines.erase(it->first.second);
+        m_timers.erase(it);
+        callback();
+    }
+}
+
+class tgl_epoll_timer : public tgl_timer, public std::enable_shared_from_this<tgl_epoll_timer>
+{
+public:
+    tgl_epoll_timer(const std::shared_ptr<tgl_epoll_loop>& loop, const std::function<void()>& cb)
+        : m_loop(loop)
+        , m_cb(cb)
+        , m_timer_id(0)
+    { }
+
+    virtual ~tgl_epoll_timer()
+    {
+        cancel();
+    }
+
+    virtual void start(double seconds_from_now) override
+    {
+        cancel();
+        std::weak_ptr<tgl_epoll_timer> weak_this(shared_from_this());
+        m_timer_id = m_loop->schedule(tgl_epoll_loop::now() + seconds_from_now, [weak_this] {
+            if (auto shared_this = weak_this.lock()) {
+                shared_this->m_timer_id = 0;
+                // The callback may destroy or restart the timer.
+                std::function<void()> cb = shared_this->m_cb;
+                cb();
+            }
+        });
+    }
+
+    virtual void cancel() override
+    {
+        if (m_timer_id) {
+            m_loop->cancel(m_timer_id);
+            m_timer_id = 0;
+        }
+    }
+
+private:
+    std::shared_ptr<tgl_epoll_loop> m_loop;
+    std::function<void()> m_cb;
+    uint64_t m_timer_id;
+};
+
+std::shared_ptr<tgl_timer> tgl_epoll_timer_factory::create_timer(const std::function<void()>& cb)
+{
+    return std::make_shared<tgl_epoll_timer>(m_loop, cb);
+}
+
+tgl_epoll_connection::tgl_epoll_connection(const std::shared_ptr<tgl_epoll_loop>& loop,
+        const std::vector<std::pair<std::string, int>>& ipv4_options,
+        const std::vector<std::pair<std::string, int>>& ipv6_options,
+        const std::weak_ptr<tgl_mtproto_client>& client)
+    : tgl_connection_base(ipv4_options, ipv6_options, client)
+    , m_loop(loop)
+    , m_fd(-1)
+    , m_connecting(false)
+{
+}
+
+tgl_epoll_connection::~tgl_epoll_connection()
+{
+    disconnect();
+}
+
+bool tgl_epoll_connection::connect()
+{
+    disconnect();
+
+    struct sockaddr_storage address;
+    memset(&address, 0, sizeof(address));
+    socklen_t address_length;
+    if (ipv6_enabled() && !m_ipv6_address.empty()) {
+        struct sockaddr_in6* address6 = reinterpret_cast<struct sockaddr_in6*>(&address);
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(m_ipv6_port);
+        if (inet_pton(AF_INET6, m_ipv6_address.c_str(), &address6->sin6_addr) != 1) {
+            TGL_ERROR("invalid IPv6 address " << m_ipv6_address);
+            return false;
+        }
+        address_length = sizeof(struct sockaddr_in6);
+    } else {
+        struct sockaddr_in* address4 = reinterpret_cast<struct sockaddr_in*>(&address);
+        address4->sin_family = AF_INET;
+        address4->sin_port = htons(m_ipv4_port);
+        if (inet_pton(AF_INET, m_ipv4_address.c_str(), &address4->sin_addr) != 1) {
+            TGL_ERROR("invalid IPv4 address " << m_ipv4_address);
+            return false;
+        }
+        address_length = sizeof(struct sockaddr_in);
+    }
+
+    m_fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+        TGL_ERROR("failed to create socket: " << strerror(errno));
+        return false;
+    }
+
+    int flag = 1;
+    setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if (::connect(m_fd, reinterpret_cast<struct sockaddr*>(&address), address_length) < 0 && errno != EINPROGRESS) {
+        TGL_ERROR("failed to connect: " << strerror(errno));
+        disconnect();
+        return false;
+    }
+
+    std::weak_ptr<tgl_connection_base> weak_this(shared_from_this());
+    bool added = m_loop->add_fd(m_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [weak_this](uint32_t events) {
+        if (auto shared_this = weak_this.lock()) {
+            static_cast<tgl_epoll_connection*>(shared_this.get())->handle_events(events);
+        }
+    });
+    if (!added) {
+        disconnect();
+        return false;
+    }
+
+    m_connecting = true;
+    return true;
+}
+
+void tgl_epoll_connection::disconnect()
+{
+    if (m_fd < 0) {
+        return;
+    }
+
+    m_loop->remove_fd(m_fd);
+    ::close(m_fd);
+    m_fd = -1;
+    m_connecting = false;
+}
+
+void tgl_epoll_connection::handle_events(uint32_t events)
+{
+    if (m_connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            TGL_WARNING("failed to connect: " << strerror(error ? error : errno));
+            disconnect();
+            connect_finished(false);
+            return;
+        }
+        m_connecting = false;
+        connect_finished(true);
+        try_write();
+    }
+
+    if (events & EPOLLIN) {
+        try_read();
+    }
+
+    if (m_fd < 0) {
+        return;
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        TGL_WARNING("connection error");
+        disconnect();
+        error();
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        try_write();
+    }
+}
+
+void tgl_epoll_connection::start_read()
+{
+    // Edge triggered, so read until the socket is drained.
+    while (m_fd >= 0) {
+        char* buffer = receive_buffer(MIN_RECEIVE_SIZE);
+        ssize_t n = recv(m_fd, buffer, receive_buffer_size(), 0);
+        if (n > 0) {
+            data_received(n);
+            continue;
+        }
+        if (n == 0) {
+            disconnect();
+            lost();
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            TGL_WARNING("failed to receive: " << strerror(errno));
+            disconnect();
+            error();
+        }
+        return;
+    }
+}
+
+void tgl_epoll_connection::start_write()
+{
+    if (m_fd < 0 || m_connecting) {
+        return;
+    }
+
+    while (!m_write_buffer_queue.empty()) {
+        struct iovec iov[MAX_WRITE_IOVECS];
+        size_t count = 0;
+        for (const auto& buffer: m_write_buffer_queue) {
+            if (count == MAX_WRITE_IOVECS) {
+                break;
+            }
+            iov[count].iov_base = buffer->data();
+            iov[count].iov_len = buffer->size();
+            ++count;
+        }
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t n = sendmsg(m_fd, &message, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                TGL_WARNING("failed to send: " << strerror(errno));
+                disconnect();
+                error();
+            }
+            return;
+        }
+
+        bytes_sent(n);
+
+        size_t sent = n;
+        while (sent) {
+            const auto& buffer = m_write_buffer_queue.front();
+            if (buffer->size() > sent) {
+                buffer->advance(sent);
+                break;
+            }
+            sent -= buffer->size();
+            m_write_buffer_queue.pop_front();
+        }
+    }
+}
+
+std::shared_ptr<tgl_connection> tgl_epoll_connection_factory::create_connection(
+        const std::vector<std::pair<std::string, int>>& ipv4_options,
+        const std::vector<std::pair<std::string, int>>& ipv6_options,
+        const std::weak_ptr<tgl_mtproto_client>& client)
+{
+    return std::make_shared<tgl_epoll_connection>(m_loop, ipv4_options, ipv6_options, client);
+}
@@ -22,11 +22,11 @@
 #include "query.h"
 
 #include "auto/auto_fetch_ds.h"
-#include "auto/auto_free_ds.h"
-#include "auto/auto_skip.h"
 #include "query_user_info.h"
 #include "tgl/tgl_timer.h"
 
+#include <algorithm>
+
 namespace tgl {
 namespace impl {
 
@@ -48,7 +48,10 @@ void query::clear_timers()
 
 inline bool query::is_in_the_same_session() const
 {
-    return m_client && m_session_id && m_client->session() && m_client->session()->session_id == m_session_id;
+    if (!m_client || !m_session_id) {
+        return false;
+    }
+    return m_client->has_session(m_session_id);
 }
 
 bool query::send()
@@ -59,7 +62,8 @@ bool query::send()
 
     TGL_DEBUG("sending query \"" << m_name << "\" of size " << m_serializer->char_size() << " to DC " << m_client->id());
 
-    m_msg_id = m_client->send_message(m_serializer->i32_data(), m_serializer->i32_size(), m_msg_id_override, is_force(), is_file_transfer());
+    const struct session* session = nullptr;
+    m_msg_id = m_client->send_message(m_serializer->i32_data(), m_serializer->i32_size(), m_msg_id_override, is_force(), is_file_transfer(), &session);
     if (m_msg_id == -1) {
         m_msg_id = 0;
         handle_error(400, "client failed to send message");
@@ -69,7 +73,8 @@ bool query::send()
         m_client->set_logout_query(shared_from_this());
     }
     m_user_agent.add_active_query(shared_from_this());
-    m_session_id = m_client->session()->session_id;
+    m_session_id = session->session_id;
+    m_seq_no = session->seq_no - 1;
     timeout_within(timeout_interval());
     sent();
 
@@ -161,7 +166,6 @@ void query::execute(const std::shared_ptr<mtproto_client>& client, execution_opt
     if (!send()) {
         return;
     }
-    m_seq_no = m_client->session()->seq_no - 1;
     TGL_DEBUG("sent query \"" << m_name << "\" of size " << m_serializer->char_size() << " to DC " << m_client->id() << ": #" << msg_id());
 }
 
@@ -492,6 +496,17 @@ void query::on_answer_internal(void* DS)
     on_answer(DS);
 }
 
+bool query::on_lazy_answer_internal(tgl_in_buffer* in)
+{
+    assert(m_client);
+    // Like an eagerly decoded answer, a malformed one leaves the query as it is.
+    if (!on_lazy_answer(in)) {
+        return false;
+    }
+    m_client->remove_connection_status_observer(shared_from_this());
+    return true;
+}
+
 int query::on_error_internal(int error_code, const std::string& error_string)
 {
     assert(m_client);
@@ -504,51 +519,62 @@ int query::handle_result(tgl_in_buffer* in)
     int32_t op = prefetch_i32(in);
 
     tgl_in_buffer save_in = { nullptr, nullptr };
-    std::unique_ptr<int32_t[]> packed_buffer;
+    std::shared_ptr<mtproto_client> client = m_client;
+    std::vector<int32_t> packed_buffer;
 
     if (op == CODE_gzip_packed) {
         fetch_i32(in);
         int l = prefetch_strlen(in);
         const char* s = fetch_str(in, l);
 
-        constexpr size_t MAX_PACKED_SIZE = 1 << 24;
-        packed_buffer.reset(new int32_t[MAX_PACKED_SIZE / 4]);
-
-        int total_out = tgl_inflate(s, l, packed_buffer.get(), MAX_PACKED_SIZE);
+        packed_buffer = client->inflater().acquire_buffer();
+        int total_out = std::max(client->inflater().inflate(s, l, packed_buffer), 0);
         TGL_DEBUG("inflated " << total_out << " bytes");
         save_in = *in;
-        in->ptr = packed_buffer.get();
+        in->ptr = packed_buffer.data();
         in->end = in->ptr + total_out / 4;
     }
 
     TGL_DEBUG("result for query #" << msg_id() << ". Size " << (long)4 * (in->end - in->ptr) << " bytes");
 
-    tgl_in_buffer skip_in = *in;
-    if (skip_type_any(&skip_in, &m_type) < 0) {
-        TGL_ERROR("skipped " << (long)(skip_in.ptr - in->ptr) << " int out of " << (long)(skip_in.end - in->ptr) << " (type " << m_type.type.id << ") (query type " << name() << ")");
-        TGL_ERROR("0x" << std::hex << *(in->ptr - 1) << " 0x" << *(in->ptr) << " 0x" << *(in->ptr + 1) << " 0x" << *(in->ptr + 2));
+    const int32_t* start = in->ptr;
+    bool success;
+    if (decodes_answer_lazily()) {
+        success = on_lazy_answer_internal(in);
+    } else {
+        // The generated decoder validates while it fetches, so the answer is parsed
+        // only once. The whole answer is decoded into one arena which is dropped in
+        // one go after the answer has been handled, instead of calling free_ds_type_any.
+        tl_ds_arena arena(decode_string_views());
+        in->arena = &arena;
+        void* DS = fetch_ds_type_any(in, &m_type);
+        in->arena = nullptr;
+        success = DS && in->ptr == in->end;
+        if (success) {
+            on_answer_internal(DS);
+        }
+    }
+
+    if (!success) {
+        TGL_ERROR("fetched " << (long)(in->ptr - start) << " int out of " << (long)(in->end - start) << " (type " << m_type.type.id << ") (query type " << name() << ")");
+        in->ptr = start;
         TGL_ERROR(in->print_buffer());
         assert(false);
+        if (save_in.ptr) {
+            *in = save_in;
+            client->inflater().release_buffer(std::move(packed_buffer));
+        }
         handle_error(600, "invaid response from the server");
         return 0;
     }
 
-    assert(skip_in.ptr == skip_in.end);
-
-    void* DS = fetch_ds_type_any(in, &m_type);
-    assert(DS);
-
-    on_answer_internal(DS);
-    free_ds_type_any(DS, &m_type);
-
-    assert(in->ptr == in->end);
-
     clear_timers();
 
     m_user_agent.remove_active_query(shared_from_this());
 
     if (save_in.ptr) {
         *in = save_in;
+        client->inflater().release_buffer(std::move(packed_buffer));
     }
 
     return 0;
@@ -98,6 +98,11 @@ public:
         m_serializer->out_string(str, size);
     }
 
+    char* out_string_buffer(size_t size)
+    {
+        return m_serializer->out_string_buffer(size);
+    }
+
     void out_string(const char* str)
     {
         m_serializer->out_string(str);
@@ -124,6 +129,12 @@ public:
     const std::shared_ptr<mtproto_client>& client() const { return m_client; }
 
     virtual void on_answer(void* DS) = 0;
+    // Queries returning true here get the raw answer in on_lazy_answer() instead of
+    // a fully decoded one in on_answer(), so they can decode it with tl_ds_lazy_vector.
+    virtual bool decodes_answer_lazily() const { return false; }
+    // Has to consume the whole answer and validate it before acting on it. Returns
+    // false, without side effects, if the answer is malformed.
+    virtual bool on_lazy_answer(tgl_in_buffer*) { return false; }
     virtual int on_error(int error_code, const std::string& error_string) = 0;
     virtual void on_timeout() { }
     virtual void on_connection_status_changed(tgl_connection_status status) { }
@@ -132,6 +143,8 @@ public:
     virtual bool should_retry_on_timeout() const { return true; }
     virtual bool should_retry_after_recover_from_error() const { return true; }
     virtual bool is_file_transfer() const { return false; }
+    // Let strings and bytes in the answer point into the receive buffer instead of being copied.
+    virtual bool decode_string_views() const { return false; }
 
     virtual void will_be_pending() { }
     virtual void will_send() { }
@@ -156,6 +169,7 @@ private:
     bool is_in_the_same_session() const;
     bool send();
     void on_answer_internal(void* DS);
+    bool on_lazy_answer_internal(tgl_in_buffer* in);
     int on_error_internal(int error_code, const std::string& error_string);
 
 protected:
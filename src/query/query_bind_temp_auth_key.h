@@ -43,6 +43,7 @@ public:
     virtual void on_answer(void*) override
     {
         m_client->set_bound();
+        m_client->store_keys();
         TGL_DEBUG("bind temp auth key successfully for DC " << m_client->id());
         m_client->configure();
     }
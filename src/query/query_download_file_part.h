@@ -40,6 +40,7 @@ public:
     virtual void on_connection_status_changed(tgl_connection_status status) override;
     virtual void will_send() override;
     virtual bool is_file_transfer() const override { return true; }
+    virtual bool decode_string_views() const override { return true; }
 
 private:
     bool download_finished() const;
@@ -21,9 +21,11 @@
 
 #include "query_get_history.h"
 
+#include "auto/auto_fetch_ds.h"
 #include "chat.h"
 #include "message.h"
 #include "tgl/tgl_update_callback.h"
+#include "tl_ds_lazy_vector.h"
 #include "user.h"
 
 namespace tgl {
@@ -41,63 +43,116 @@ query_get_history::query_get_history(user_agent& ua, const tgl_input_peer_t& id,
     , m_callback(callback)
 { }
 
-void query_get_history::on_answer(void* D)
+void query_get_history::on_answer(void*)
 {
-    TGL_DEBUG("get history on answer for query #" << msg_id());
-    const tl_ds_messages_messages* DS_MM = static_cast<const tl_ds_messages_messages*>(D);
+    // Never called: the answer is decoded lazily, in on_lazy_answer().
+}
 
-    int32_t n = DS_LVAL(DS_MM->chats->cnt);
-    for (int32_t i = 0; i < n; ++i) {
-        if (auto c = chat::create(DS_MM->chats->data[i])) {
-            m_user_agent.chat_fetched(c);
-        }
+bool query_get_history::on_lazy_answer(tgl_in_buffer* in)
+{
+    TGL_DEBUG("get history on lazy answer for query #" << msg_id());
+
+    if (in_remaining(in) < 4) {
+        return false;
     }
-    n = DS_LVAL(DS_MM->users->cnt);
-    for (int32_t i = 0; i < n; ++i) {
-        if (auto u = user::create(DS_MM->users->data[i])) {
-            m_user_agent.user_fetched(u);
+
+    int32_t flags = 0;
+    uint32_t magic = fetch_i32(in);
+    switch (magic) {
+    case CODE_messages_messages:
+        break;
+    case CODE_messages_messages_slice:
+        if (in_remaining(in) < 4) {
+            return false;
         }
+        fetch_i32(in); // count
+        break;
+    case CODE_messages_channel_messages:
+        if (in_remaining(in) < 12) {
+            return false;
+        }
+        flags = fetch_i32(in);
+        fetch_i32(in); // pts
+        fetch_i32(in); // count
+        break;
+    default:
+        return false;
+    }
+
+    tl_ds_lazy_vector<tl_ds_message> messages(TYPE_TO_PARAM(message), fetch_ds_type_message);
+    if (!messages.skip(in)) {
+        return false;
     }
-    n = DS_LVAL(DS_MM->messages->cnt);
-    for (int32_t i = 0; i < n; ++i) {
-        if (auto m = message::create(m_user_agent.our_id(), DS_MM->messages->data[i])) {
-            m->set_history(true);
-            m_messages.push_back(m);
+
+    if (magic == CODE_messages_channel_messages && (flags & 1)) {
+        tl_ds_lazy_vector<tl_ds_message_group> collapsed(TYPE_TO_PARAM(message_group), fetch_ds_type_message_group);
+        if (!collapsed.skip(in)) {
+            return false;
         }
     }
-    m_user_agent.callback()->new_messages(m_messages);
 
-#if 0
-    m_offset += n;
-    m_limit -= n;
-
-    int count = DS_LVAL(DS_MM->count);
-    if (count >= 0 && m_limit + m_offset >= count) {
-        m_limit = count - m_offset;
-        if (m_limit < 0) {
-            m_limit = 0;
+    tl_ds_lazy_vector<tl_ds_chat> chats(TYPE_TO_PARAM(chat), fetch_ds_type_chat);
+    tl_ds_lazy_vector<tl_ds_user> users(TYPE_TO_PARAM(user), fetch_ds_type_user);
+    if (!chats.skip(in) || !users.skip(in) || in->ptr != in->end) {
+        return false;
+    }
+
+    // Only one element is decoded at a time, reusing the same arena memory.
+    tl_ds_arena arena(decode_string_views());
+    for (size_t i = 0; i < chats.size(); ++i) {
+        chat_fetched(chats.fetch(i, arena));
+        arena.reset();
+    }
+    for (size_t i = 0; i < users.size(); ++i) {
+        user_fetched(users.fetch(i, arena));
+        arena.reset();
+    }
+    for (size_t i = 0; i < messages.size(); ++i) {
+        if (messages.magic(i) == CODE_message_empty) {
+            continue;
         }
+        message_fetched(messages.fetch(i, arena));
+        arena.reset();
     }
-    assert(m_limit >= 0);
-#endif
 
-    if (m_callback) {
-        m_callback(true, m_messages);
+    done();
+
+    return true;
+}
+
+void query_get_history::chat_fetched(const tl_ds_chat* DS_C)
+{
+    if (auto c = chat::create(DS_C)) {
+        m_user_agent.chat_fetched(c);
     }
+}
 
-#if 0
-    if (m_limit <= 0 || DS_MM->magic == CODE_messages_messages || DS_MM->magic == CODE_messages_channel_messages) {
-
-        /*if (m_messages.size() > 0) {
-          tgl_do_messages_mark_read(m_id, m_messages[0]->id, 0, 0, 0);
-        }*/
-    } else {
-        /*m_offset = 0;
-        m_max_id = m_messages[m_messages.size()-1]->permanent_id.id;
-        _tgl_do_get_history(m_id, m_offset, m_limit, m_max_id,
-                m_callback);*/
+void query_get_history::user_fetched(const tl_ds_user* DS_U)
+{
+    if (!DS_U) {
+        return;
+    }
+
+    if (auto u = user::create(DS_U)) {
+        m_user_agent.user_fetched(u);
+    }
+}
+
+void query_get_history::message_fetched(const tl_ds_message* DS_M)
+{
+    if (auto m = message::create(m_user_agent.our_id(), DS_M)) {
+        m->set_history(true);
+        m_messages.push_back(m);
+    }
+}
+
+void query_get_history::done()
+{
+    m_user_agent.callback()->new_messages(m_messages);
+
+    if (m_callback) {
+        m_callback(true, m_messages);
     }
-#endif
 }
 
 int query_get_history::on_error(int error_code, const std::string& error_string)
@@ -40,6 +40,15 @@ public:
             const std::function<void(bool, const std::vector<std::shared_ptr<tgl_message>>&)>& callback);
     virtual void on_answer(void* D) override;
     virtual int on_error(int error_code, const std::string& error_string) override;
+    virtual bool decode_string_views() const override { return true; }
+    virtual bool decodes_answer_lazily() const override { return true; }
+    virtual bool on_lazy_answer(tgl_in_buffer* in) override;
+
+private:
+    void chat_fetched(const tl_ds_chat*);
+    void user_fetched(const tl_ds_user*);
+    void message_fetched(const tl_ds_message*);
+    void done();
 
 private:
     std::vector<std::shared_ptr<tgl_message>> m_messages;
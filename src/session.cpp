@@ -30,7 +30,6 @@ namespace impl {
 void session::clear()
 {
     session_id = 0;
-    last_msg_id = 0;
     seq_no = 0;
     received_messages = 0;
     if (primary_worker) {
@@ -45,9 +44,17 @@ void session::clear()
         }
     }
     secondary_workers.clear();
+    in_flight_messages.clear();
     ack_set.clear();
+    acks_unsent = false;
     ev->cancel();
     ev = nullptr;
+    if (flush_timer) {
+        flush_timer->cancel();
+        flush_timer = nullptr;
+    }
+    flush_timer_armed = false;
+    sent_containers.clear();
 }
 
 }
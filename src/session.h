@@ -21,8 +21,10 @@
 
 #pragma once
 
+#include "msg_id_map.h"
 #include "tgl/tgl_timer.h"
 
+#include <deque>
 #include <memory>
 #include <set>
 #include <stdint.h>
@@ -40,27 +42,61 @@ struct worker
 {
     std::shared_ptr<tgl_connection> connection;
     std::shared_ptr<tgl_timer> live_timer;
-    std::set<int64_t> work_load;
-    explicit worker(const std::shared_ptr<tgl_connection>& c): connection(c) { }
+    // The number and total size of the messages sent through this worker which are still
+    // waiting for their answer.
+    size_t work_load;
+    size_t bytes_in_flight;
+    // Smoothed round trip time of the answered messages and the rate they were sent at in
+    // bytes per second, 0 until the first answer.
+    double srtt;
+    double throughput;
+    // Messages waiting to be sent together in one msg_container, already laid out
+    // as container entries, and their ids.
+    std::vector<int32_t> queued_messages;
+    std::vector<int64_t> queued_msg_ids;
+    explicit worker(const std::shared_ptr<tgl_connection>& c): connection(c), work_load(0), bytes_in_flight(0), srtt(0), throughput(0) { }
 };
 
+struct in_flight_message
+{
+    std::shared_ptr<worker> owner;
+    size_t bytes = 0;
+    double sent_time = 0;
+    // A resent message's answer can't be matched to one of its sends, so it gives no RTT sample.
+    bool resent = false;
+};
+
+// A client talks to its DC in a main session, which sends everything through its
+// primary worker, and, for file transfers, in a media session. The media session
+// has no primary worker and spreads the transfers over its secondary workers, so
+// they neither hold up nor share seq_no and acks with the main session's messages.
 struct session
 {
     int64_t session_id;
-    int64_t last_msg_id;
     int32_t seq_no;
     int32_t received_messages;
     std::shared_ptr<worker> primary_worker;
     std::unordered_set<std::shared_ptr<worker>> secondary_workers;
     std::set<int64_t> ack_set;
+    // The acks in ack_set could not be sent and wait for the next message.
+    bool acks_unsent;
+    // The worker each in flight message was sent through, counted in its work_load.
+    msg_id_map<in_flight_message> in_flight_messages;
     std::shared_ptr<tgl_timer> ev;
+    std::shared_ptr<tgl_timer> flush_timer;
+    bool flush_timer_armed;
+    // The ids of the messages in the most recently sent containers, so that
+    // notifications about a container can be applied to the messages in it.
+    std::deque<std::pair<int64_t, std::vector<int64_t>>> sent_containers;
     session()
         : session_id(0)
-        , last_msg_id(0)
         , seq_no(0)
         , received_messages(0)
         , ack_set()
+        , acks_unsent(false)
         , ev()
+        , flush_timer()
+        , flush_timer_armed(false)
     { }
 
     void clear();
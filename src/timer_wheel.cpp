@@ -0,0 +1,296 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace tgl {
+namespace impl {
+
+constexpr std::chrono::milliseconds timer_wheel::TICK;
+
+static constexpr uint64_t NO_TICK = std::numeric_limits<uint64_t>::max();
+
+class timer_wheel::timer : public tgl_timer, public timer_wheel_node, public std::enable_shared_from_this<timer_wheel::timer>
+{
+public:
+    timer(const std::shared_ptr<timer_wheel>& wheel, const std::function<void()>& cb)
+        : m_wheel(wheel)
+        , m_cb(cb)
+        , m_expiry(0)
+    { }
+
+    virtual ~timer()
+    {
+        cancel();
+    }
+
+    virtual void start(double seconds_from_now) override
+    {
+        cancel();
+        if (seconds_from_now <= 0) {
+            m_wheel->add_immediate(this);
+            return;
+        }
+        // Round up to the next tick boundary so that a timer never fires early.
+        double expiry = m_wheel->current_time_in_ticks() + std::max(seconds_from_now, 0.0) * 1000 / TICK.count();
+        m_expiry = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(expiry)), m_wheel->m_current_tick + 1);
+        m_wheel->add(this);
+    }
+
+    virtual void cancel() override
+    {
+        if (is_linked()) {
+            m_wheel->remove(this);
+        }
+    }
+
+private:
+    friend class timer_wheel;
+
+    std::shared_ptr<timer_wheel> m_wheel;
+    std::function<void()> m_cb;
+    uint64_t m_expiry;
+};
+
+timer_wheel::timer_wheel(const std::shared_ptr<tgl_timer_factory>& host_factory, const clock_function& clock)
+    : m_host_factory(host_factory)
+    , m_host_timer()
+    , m_clock(clock)
+    , m_start_time(m_clock())
+    , m_current_tick(0)
+    , m_host_timer_tick(NO_TICK)
+    , m_pending_timers(0)
+{
+}
+
+timer_wheel::~timer_wheel()
+{
+    assert(!m_pending_timers);
+    if (m_host_timer) {
+        m_host_timer->cancel();
+    }
+}
+
+std::shared_ptr<tgl_timer> timer_wheel::create_timer(const std::function<void()>& cb)
+{
+    return std::make_shared<timer>(shared_from_this(), cb);
+}
+
+double timer_wheel::current_time_in_ticks() const
+{
+    return std::chrono::duration<double, std::milli>(m_clock() - m_start_time).count() / TICK.count();
+}
+
+uint64_t timer_wheel::current_time_tick() const
+{
+    return static_cast<uint64_t>(current_time_in_ticks());
+}
+
+void timer_wheel::add(timer* t)
+{
+    assert(!t->is_linked());
+
+    // Timers are only added for the current tick while it is cascaded, before its slot is processed.
+    assert(t->m_expiry >= m_current_tick);
+    uint64_t expiry = t->m_expiry;
+    uint64_t delta = expiry - m_current_tick;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (SLOTS << (level * SLOT_BITS))) {
+        ++level;
+    }
+    if (delta >= (uint64_t(1) << (LEVELS * SLOT_BITS))) {
+        // Beyond the range of the wheel, keep the timer in the last slot of the top level.
+        expiry = m_current_tick + (uint64_t(SLOT_MASK) << ((LEVELS - 1) * SLOT_BITS));
+    }
+
+    t->m_expiry = expiry;
+    uint64_t index = (expiry >> (level * SLOT_BITS)) & SLOT_MASK;
+    timer_wheel_node& slot = m_slots[level][index];
+    uint64_t& min_expiry = m_slot_min_expiry[level][index];
+    min_expiry = slot.is_linked() ? std::min(min_expiry, expiry) : expiry;
+    t->link_before(&slot);
+    ++m_pending_timers;
+
+    if (expiry < m_host_timer_tick) {
+        arm_host_timer(expiry);
+    }
+}
+
+void timer_wheel::add_immediate(timer* t)
+{
+    assert(!t->is_linked());
+    t->link_before(&m_immediate_timers);
+    ++m_pending_timers;
+
+    // Marks the host timer as due now, so that later timers don't re-arm it.
+    if (m_host_timer_tick != m_current_tick) {
+        arm_host_timer(m_current_tick);
+    }
+}
+
+void timer_wheel::remove(timer* t)
+{
+    assert(t->is_linked());
+    t->unlink();
+    --m_pending_timers;
+}
+
+void timer_wheel::cascade(int level)
+{
+    timer_wheel_node& slot = m_slots[level][(m_current_tick >> (level * SLOT_BITS)) & SLOT_MASK];
+    while (slot.is_linked()) {
+        timer* t = static_cast<timer*>(slot.next);
+        remove(t);
+        add(t);
+    }
+}
+
+void timer_wheel::fire(timer_wheel_node& slot)
+{
+    // Take the due timers out of the wheel first, as the callbacks may start
+    // and cancel any timers, including the ones due at the same tick.
+    timer_wheel_node due;
+    if (slot.is_linked()) {
+        due.link_before(&slot);
+        slot.unlink();
+    }
+
+    while (due.is_linked()) {
+        timer* t = static_cast<timer*>(due.next);
+        remove(t);
+        std::shared_ptr<timer> keep_alive = t->shared_from_this();
+        t->m_cb();
+    }
+}
+
+void timer_wheel::advance()
+{
+    // The timers started with no delay since the last advance. The ones their callbacks
+    // start again wait for the next one.
+    fire(m_immediate_timers);
+
+    uint64_t now_tick = current_time_tick();
+    while (m_pending_timers) {
+        uint64_t next_tick = next_slot_tick();
+        if (next_tick > now_tick) {
+            break;
+        }
+        m_current_tick = next_tick;
+
+        for (int level = 1; level < LEVELS; ++level) {
+            if ((m_current_tick >> ((level - 1) * SLOT_BITS)) & SLOT_MASK) {
+                break;
+            }
+            cascade(level);
+        }
+
+        fire(m_slots[0][m_current_tick & SLOT_MASK]);
+    }
+
+    // No slot starts before now_tick any more, so the wheel can skip ahead to it.
+    m_current_tick = std::max(m_current_tick, now_tick);
+}
+
+void timer_wheel::arm_host_timer(uint64_t tick)
+{
+    if (!m_host_timer) {
+        std::weak_ptr<timer_wheel> weak_this(shared_from_this());
+        m_host_timer = m_host_factory->create_timer([weak_this] {
+            if (auto shared_this = weak_this.lock()) {
+                shared_this->m_host_timer_tick = NO_TICK;
+                shared_this->advance();
+                shared_this->arm_host_timer_for_next_expiry();
+            }
+        });
+    }
+
+    m_host_timer_tick = tick;
+    double delay = (tick - current_time_in_ticks()) * TICK.count() / 1000;
+    m_host_timer->start(std::max(delay, 0.0));
+}
+
+void timer_wheel::arm_host_timer_for_next_expiry()
+{
+    if (!m_pending_timers) {
+        if (m_host_timer && m_host_timer_tick != NO_TICK) {
+            m_host_timer->cancel();
+            m_host_timer_tick = NO_TICK;
+        }
+        return;
+    }
+
+    uint64_t next_tick = m_immediate_timers.is_linked() ? m_current_tick : earliest_expiry();
+
+    if (next_tick < m_host_timer_tick) {
+        arm_host_timer(next_tick);
+    }
+}
+
+// A level's nearest non-empty slot holds its earliest timers. A timer which is a full round
+// of its level ahead shares the current slot, so that slot comes last.
+bool timer_wheel::nearest_slot(int level, uint64_t& start, uint64_t& index) const
+{
+    uint64_t current_slot = m_current_tick >> (level * SLOT_BITS);
+    for (uint64_t distance = 1; distance <= SLOTS; ++distance) {
+        index = (current_slot + distance) & SLOT_MASK;
+        if (m_slots[level][index].is_linked()) {
+            start = (current_slot + distance) << (level * SLOT_BITS);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The next tick at which a slot is due, to be fired or cascaded.
+uint64_t timer_wheel::next_slot_tick() const
+{
+    uint64_t next_tick = NO_TICK;
+    for (int level = 0; level < LEVELS; ++level) {
+        uint64_t start;
+        uint64_t index;
+        if (nearest_slot(level, start, index)) {
+            next_tick = std::min(next_tick, start);
+        }
+    }
+    return next_tick;
+}
+
+// Timers in the higher levels keep their exact expiry, so the host timer wakes up for the
+// earliest of them rather than at every cascade.
+uint64_t timer_wheel::earliest_expiry() const
+{
+    uint64_t expiry = NO_TICK;
+    for (int level = 0; level < LEVELS; ++level) {
+        uint64_t start;
+        uint64_t index;
+        if (nearest_slot(level, start, index)) {
+            expiry = std::min(expiry, m_slot_min_expiry[level][index]);
+        }
+    }
+    return expiry;
+}
+
+}
+}
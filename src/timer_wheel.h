@@ -0,0 +1,123 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include "tgl/tgl_timer.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace tgl {
+namespace impl {
+
+class timer_wheel;
+
+// A node in the circular doubly linked lists of the wheel slots.
+struct timer_wheel_node
+{
+    timer_wheel_node* prev;
+    timer_wheel_node* next;
+
+    timer_wheel_node() : prev(this), next(this) { }
+    timer_wheel_node(const timer_wheel_node&) = delete;
+    timer_wheel_node& operator=(const timer_wheel_node&) = delete;
+
+    bool is_linked() const { return next != this; }
+
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
+
+    void link_before(timer_wheel_node* node)
+    {
+        prev = node->prev;
+        next = node;
+        node->prev->next = this;
+        node->prev = this;
+    }
+};
+
+// A hierarchical timer wheel serving all of the library's timers from a single
+// timer of the host. Starting and cancelling a timer is O(1) and doesn't allocate.
+// When the host timer fires the wheel jumps from one non-empty slot to the next, so
+// the work doesn't grow with how far ahead the timers are.
+// Timers fire at a resolution of TICK, on the thread the host timer fires on. Timers
+// started with a delay of 0 or less are not rounded to a tick: they fire the next
+// time the host timer does, which is armed to fire right away.
+class timer_wheel : public tgl_timer_factory, public std::enable_shared_from_this<timer_wheel>
+{
+public:
+    static constexpr std::chrono::milliseconds TICK{10};
+
+    using clock_function = std::function<std::chrono::steady_clock::time_point()>;
+
+    // clock is only replaced in tests.
+    explicit timer_wheel(const std::shared_ptr<tgl_timer_factory>& host_factory,
+            const clock_function& clock = std::chrono::steady_clock::now);
+    ~timer_wheel();
+
+    virtual std::shared_ptr<tgl_timer> create_timer(const std::function<void()>& cb) override;
+
+private:
+    class timer;
+    friend class timer;
+
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+    double current_time_in_ticks() const;
+    uint64_t current_time_tick() const;
+    void add(timer* t);
+    void add_immediate(timer* t);
+    void remove(timer* t);
+    void cascade(int level);
+    void advance();
+    void fire(timer_wheel_node& slot);
+    void arm_host_timer(uint64_t tick);
+    void arm_host_timer_for_next_expiry();
+    bool nearest_slot(int level, uint64_t& start, uint64_t& index) const;
+    uint64_t next_slot_tick() const;
+    uint64_t earliest_expiry() const;
+
+    std::shared_ptr<tgl_timer_factory> m_host_factory;
+    std::shared_ptr<tgl_timer> m_host_timer;
+    clock_function m_clock;
+    std::chrono::steady_clock::time_point m_start_time;
+    uint64_t m_current_tick;
+    uint64_t m_host_timer_tick;
+    size_t m_pending_timers;
+    std::array<std::array<timer_wheel_node, SLOTS>, LEVELS> m_slots;
+    // The earliest expiry in each non-empty slot. Cancelled timers may leave it too early,
+    // which only wakes the host up once for the slot before it is cascaded.
+    std::array<std::array<uint64_t, SLOTS>, LEVELS> m_slot_min_expiry;
+    timer_wheel_node m_immediate_timers;
+};
+
+}
+}
@@ -0,0 +1,75 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "tl_ds_arena.h"
+
+namespace tgl {
+namespace impl {
+
+constexpr size_t tl_ds_arena::ALIGNMENT;
+constexpr size_t tl_ds_arena::INITIAL_CHUNK_SIZE;
+constexpr size_t tl_ds_arena::MAX_CHUNK_SIZE;
+
+void* tl_ds_arena::allocate_slow(size_t size)
+{
+    // Big objects (like the bytes of a file part) get a chunk of their own so
+    // that the tail of the current chunk can still be used for small ones.
+    if (size > m_next_chunk_size / 2) {
+        m_chunks.push_back(chunk{ std::unique_ptr<char[]>(new char[size]), size, true });
+        return m_chunks.back().data.get();
+    }
+
+    size_t chunk_size = m_next_chunk_size;
+    if (m_next_chunk_size < MAX_CHUNK_SIZE) {
+        m_next_chunk_size *= 2;
+    }
+
+    m_chunks.push_back(chunk{ std::unique_ptr<char[]>(new char[chunk_size]), chunk_size, false });
+    m_current = m_chunks.back().data.get() + size;
+    m_remaining = chunk_size - size;
+    return m_chunks.back().data.get();
+}
+
+void tl_ds_arena::reset()
+{
+    m_next_chunk_size = INITIAL_CHUNK_SIZE;
+    if (m_chunks.empty() || m_chunks.front().dedicated) {
+        m_chunks.clear();
+        m_current = nullptr;
+        m_remaining = 0;
+        return;
+    }
+
+    m_chunks.resize(1);
+    m_current = m_chunks.front().data.get();
+    m_remaining = m_chunks.front().size;
+}
+
+size_t tl_ds_arena::allocated_bytes() const
+{
+    size_t total = 0;
+    for (const auto& c: m_chunks) {
+        total += c.size;
+    }
+    return total;
+}
+
+}
+}
@@ -0,0 +1,91 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace tgl {
+namespace impl {
+
+// A bump allocator for the tl_ds_* trees produced by the generated fetch_ds_*
+// decoders. Everything allocated from it is released at once when the arena is
+// destroyed, so a tree decoded into an arena must not be passed to free_ds_*.
+//
+// With string_views set, strings and bytes are not copied at all: their data
+// points straight into the buffer being decoded and is not NUL terminated. The
+// decoded tree is then only valid as long as that buffer is.
+class tl_ds_arena
+{
+public:
+    explicit tl_ds_arena(bool string_views = false)
+        : m_current(nullptr)
+        , m_remaining(0)
+        , m_next_chunk_size(INITIAL_CHUNK_SIZE)
+        , m_string_views(string_views)
+    { }
+
+    tl_ds_arena(const tl_ds_arena&) = delete;
+    tl_ds_arena& operator=(const tl_ds_arena&) = delete;
+
+    void* allocate(size_t size)
+    {
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if (size > m_remaining) {
+            return allocate_slow(size);
+        }
+        void* result = m_current;
+        m_current += size;
+        m_remaining -= size;
+        return result;
+    }
+
+    // Makes all memory handed out so far available again. Keeps the first chunk unless it
+    // was one for a single big object.
+    void reset();
+
+    size_t allocated_bytes() const;
+    bool string_views() const { return m_string_views; }
+
+private:
+    void* allocate_slow(size_t size);
+
+    static constexpr size_t ALIGNMENT = alignof(std::max_align_t);
+    static constexpr size_t INITIAL_CHUNK_SIZE = 16 * 1024;
+    static constexpr size_t MAX_CHUNK_SIZE = 1024 * 1024;
+
+    struct chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+        bool dedicated;
+    };
+
+    std::vector<chunk> m_chunks;
+    char* m_current;
+    size_t m_remaining;
+    size_t m_next_chunk_size;
+    bool m_string_views;
+};
+
+}
+}
@@ -0,0 +1,94 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include "auto/auto.h"
+#include "auto/auto_skip.h"
+#include "mtproto_common.h"
+#include "tl_ds_arena.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tgl {
+namespace impl {
+
+// A boxed Vector<T> in a buffer which is validated up front but whose elements
+// are only decoded when they are fetched. The buffer has to outlive the vector.
+template<typename T>
+class tl_ds_lazy_vector
+{
+public:
+    using fetch_function = T* (*)(tgl_in_buffer*, const paramed_type*);
+
+    tl_ds_lazy_vector(const paramed_type& element_type, fetch_function fetch)
+        : m_element_type(element_type)
+        , m_fetch(fetch)
+    { }
+
+    // Skips the vector at the current position of the buffer, remembering where
+    // each element starts. Returns false if the vector is malformed.
+    bool skip(tgl_in_buffer* in)
+    {
+        m_offsets.clear();
+        if (in_remaining(in) < 8 || fetch_i32(in) != static_cast<int32_t>(CODE_vector)) {
+            return false;
+        }
+
+        int32_t count = fetch_i32(in);
+        if (count < 0 || count > in_remaining(in)) {
+            return false;
+        }
+
+        m_offsets.reserve(count + 1);
+        for (int32_t i = 0; i < count; ++i) {
+            m_offsets.push_back(in->ptr);
+            if (skip_type_any(in, &m_element_type) < 0) {
+                m_offsets.clear();
+                return false;
+            }
+        }
+        m_offsets.push_back(in->ptr);
+
+        return true;
+    }
+
+    size_t size() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+
+    // The constructor magic of an element, which is available without decoding it.
+    uint32_t magic(size_t i) const { return static_cast<uint32_t>(*m_offsets[i]); }
+
+    T* fetch(size_t i, tl_ds_arena& arena) const
+    {
+        tgl_in_buffer in = { m_offsets[i], m_offsets[i + 1] };
+        in.arena = &arena;
+        return m_fetch(&in, &m_element_type);
+    }
+
+private:
+    const paramed_type m_element_type;
+    fetch_function m_fetch;
+    std::vector<const int32_t*> m_offsets;
+};
+
+}
+}
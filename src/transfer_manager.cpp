@@ -25,8 +25,8 @@
 #include "auto/auto_free_ds.h"
 #include "auto/auto_skip.h"
 #include "auto/auto_types.h"
-#include "crypto/crypto_aes.h"
 #include "crypto/crypto_md5.h"
+#include "crypto_work_queue.h"
 #include "download_task.h"
 #include "message.h"
 #include "mtproto_client.h"
@@ -42,6 +42,7 @@
 #include "tgl/tgl_update_callback.h"
 #include "upload_task.h"
 
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <limits>
 
@@ -49,6 +50,8 @@ namespace tgl {
 namespace impl {
 
 static constexpr size_t MAX_PART_SIZE = 512 * 1024;
+static constexpr size_t DEFAULT_MAX_BYTES_IN_FLIGHT_PER_TRANSFER = 16 * MAX_PART_SIZE;
+static constexpr size_t DEFAULT_MAX_BYTES_IN_FLIGHT = 64 * MAX_PART_SIZE;
 
 class query_set_photo: public query
 {
@@ -83,6 +86,16 @@ private:
     std::function<void(bool)> m_callback;
 };
 
+transfer_manager::transfer_manager(const std::weak_ptr<user_agent>& weak_ua, const std::string& download_directory)
+    : m_user_agent(weak_ua)
+    , m_download_directory(download_directory)
+    , m_max_bytes_in_flight_per_transfer(DEFAULT_MAX_BYTES_IN_FLIGHT_PER_TRANSFER)
+    , m_max_bytes_in_flight(DEFAULT_MAX_BYTES_IN_FLIGHT)
+    , m_scheduling_parts(false)
+    , m_reschedule_parts(false)
+{
+}
+
 bool transfer_manager::file_exists(const tgl_file_location &location) const
 {
     std::string path = get_file_path(location.access_hash());
@@ -314,6 +327,8 @@ void transfer_manager::upload_end(const std::shared_ptr<upload_task>& u)
     TGL_DEBUG("uploaded all parts");
 
     m_uploads.erase(it);
+    // Whatever this upload had in flight no longer counts against the global limit.
+    schedule_parts();
 
     if (u->status != tgl_upload_status::uploading) {
         return;
@@ -334,16 +349,10 @@ void transfer_manager::upload_end(const std::shared_ptr<upload_task>& u)
     return;
 }
 
-void transfer_manager::upload_multiple_parts(const std::shared_ptr<upload_task>&u, size_t count)
-{
-    for (size_t i = 0; u->part_num * MAX_PART_SIZE < u->size && i < count; ++i) {
-        upload_part(u);
-    }
-}
-
 void transfer_manager::upload_part_finished(const std::shared_ptr<upload_task>& u, size_t part_number, bool success)
 {
     u->running_parts.erase(part_number);
+    u->window.part_finished(part_number);
 
     u->uploaded_bytes += MAX_PART_SIZE;
     if (u->uploaded_bytes > u->size) {
@@ -366,11 +375,10 @@ void transfer_manager::upload_part_finished(const std::shared_ptr<upload_task>&
         u->set_status(tgl_upload_status::uploading);
     }
 
-    if (u->part_num * MAX_PART_SIZE < u->size) {
-        upload_part(u);
-    } else if (u->running_parts.empty()) {
+    if (u->part_num * MAX_PART_SIZE >= u->size && u->running_parts.empty()) {
         upload_end(u);
     }
+    schedule_parts();
 }
 
 void transfer_manager::upload_part(const std::shared_ptr<upload_task>& u)
@@ -385,6 +393,7 @@ void transfer_manager::upload_part(const std::shared_ptr<upload_task>& u)
 
     auto offset = u->part_num * MAX_PART_SIZE;
     u->running_parts.insert(u->part_num);
+    u->window.part_started(u->part_num);
     auto q = std::make_shared<query_upload_file_part>(*ua, u, std::bind(&transfer_manager::upload_part_finished,
             shared_from_this(), u, u->part_num, std::placeholders::_1));
     if (u->size < BIG_FILE_THRESHOLD) {
@@ -398,8 +407,26 @@ void transfer_manager::upload_part(const std::shared_ptr<upload_task>& u)
         q->out_i32((u->size + MAX_PART_SIZE - 1) / MAX_PART_SIZE);
     }
 
-    auto sending_buffer = u->read_callback(MAX_PART_SIZE);
-    size_t read_size = sending_buffer->size();
+    size_t read_size = 0;
+    unsigned char* part_data = nullptr;
+    std::shared_ptr<std::vector<uint8_t>> sending_buffer;
+    if (u->source) {
+        // Read straight into the query, leaving room for the padding of an encrypted file. The
+        // query keeps the part to be able to resend it, so sending still copies it once, into
+        // the encrypted frame.
+        read_size = std::min<uintmax_t>(MAX_PART_SIZE, u->size - std::min<uintmax_t>(offset, u->size));
+        size_t string_size = u->is_encrypted() ? (read_size + 15) & ~static_cast<size_t>(15) : read_size;
+        part_data = reinterpret_cast<unsigned char*>(q->out_string_buffer(string_size));
+        if (read_size && u->source->read(offset, reinterpret_cast<char*>(part_data), read_size) != static_cast<int64_t>(read_size)) {
+            TGL_ERROR("failed to read " << read_size << " bytes at offset " << offset << " of the file to upload");
+            u->set_status(tgl_upload_status::failed);
+            upload_end(u);
+            return;
+        }
+    } else {
+        sending_buffer = u->read_callback(MAX_PART_SIZE);
+        read_size = sending_buffer->size();
+    }
 
     if (read_size == 0) {
         TGL_WARNING("could not send empty file");
@@ -411,25 +438,39 @@ void transfer_manager::upload_part(const std::shared_ptr<upload_task>& u)
     assert(read_size > 0);
     offset += read_size;
 
+    if (offset != u->size) {
+        assert(MAX_PART_SIZE == read_size);
+    }
+
     if (u->is_encrypted()) {
-        if (read_size & 15) {
-            assert(offset == u->size);
-            int32_t padding_size = (-read_size) & 15;
+        int32_t padding_size = (-read_size) & 15;
+        if (sending_buffer) {
             sending_buffer->resize(read_size + padding_size);
-            tgl_secure_random(reinterpret_cast<unsigned char*>(sending_buffer->data()) + read_size, padding_size);
+            part_data = reinterpret_cast<unsigned char*>(sending_buffer->data());
+        }
+        if (padding_size) {
+            assert(offset == u->size);
+            tgl_secure_random(part_data + read_size, padding_size);
             read_size += padding_size;
         }
 
-        TGLC_aes_key aes_key;
-        TGLC_aes_set_encrypt_key(u->key.data(), 256, &aes_key);
-        TGLC_aes_ige_encrypt(reinterpret_cast<unsigned char*>(sending_buffer->data()),
-                reinterpret_cast<unsigned char*>(sending_buffer->data()), read_size, &aes_key, u->iv.data(), 1);
-        memset(&aes_key, 0, sizeof(aes_key));
+        // The part is sent once the crypto worker has encrypted it. u holds the iv and q the
+        // message the part may have been read into, which mustn't grow until then.
+        std::weak_ptr<user_agent> weak_ua = ua;
+        crypto_queue(ua).encrypt(u->key.data(), u->iv.data(), part_data, read_size,
+                [weak_ua, u, q, sending_buffer, read_size](bool) {
+            if (sending_buffer) {
+                q->out_string(reinterpret_cast<const char*>(sending_buffer->data()), read_size);
+            }
+            if (auto ua = weak_ua.lock()) {
+                q->execute(ua->active_client());
+            }
+        });
+        return;
     }
-    q->out_string(reinterpret_cast<const char*>(sending_buffer->data()), read_size);
 
-    if (offset != u->size) {
-        assert(MAX_PART_SIZE == read_size);
+    if (sending_buffer) {
+        q->out_string(reinterpret_cast<const char*>(sending_buffer->data()), read_size);
     }
     q->execute(ua->active_client());
 }
@@ -480,10 +521,18 @@ void transfer_manager::upload_document(const tgl_input_peer_t& to_id,
     auto u = std::make_shared<upload_task>();
     u->callback = callback;
     u->read_callback = read_callback;
+    u->source = document->source;
     u->part_done_callback = done_callback;
 
     u->size = document->file_size;
 
+    if (!u->source && !u->read_callback) {
+        TGL_ERROR("there is nothing to read the file to upload from");
+        u->set_status(tgl_upload_status::failed);
+        upload_end(u);
+        return;
+    }
+
     u->set_status(tgl_upload_status::waiting);
 
     static constexpr int MAX_PARTS = 3000; // How do we get this number?
@@ -543,12 +592,13 @@ void transfer_manager::upload_document(const tgl_input_peer_t& to_id,
 
     m_uploads[message_id] = u;
 
+    // Start with a part per connection and let the window find the rest.
+    u->window.reset(ua->active_client()->max_connections() * MAX_PART_SIZE,
+            m_max_bytes_in_flight_per_transfer, MAX_PART_SIZE);
     if (!u->is_encrypted() && thumb_size > 0) {
         upload_thumb(u);
-        upload_multiple_parts(u, ua->active_client()->max_connections() - 1);
-    } else {
-        upload_multiple_parts(u, ua->active_client()->max_connections());
     }
+    schedule_parts();
 }
 
 void transfer_manager::upload_photo(const tgl_input_peer_t& chat_id, const std::string& file_name, int32_t file_size,
@@ -676,8 +726,10 @@ void transfer_manager::download_end(const std::shared_ptr<download_task>& d)
     }
 
     m_downloads.erase(it);
+    schedule_parts();
 
     d->file_stream.reset();
+    d->output.reset();
 
     if (d->status != tgl_download_status::downloading && !d->file_name.empty()) {
         boost::system::error_code ec;
@@ -703,7 +755,20 @@ void transfer_manager::download_part_finished(const std::shared_ptr<download_tas
         return;
     }
 
-    if (!d->file_stream) {
+    d->window.part_finished(offset);
+
+    if (!d->iv.empty()) {
+        if (!d->output) {
+            d->output = output_file::open(d->file_name);
+            if (!d->output) {
+                TGL_ERROR("can not open file [" << d->file_name << "] for writing");
+                d->set_status(tgl_download_status::failed);
+                d->running_parts.clear();
+                download_end(d);
+                return;
+            }
+        }
+    } else if (!d->file_stream) {
         d->file_stream = std::make_unique<std::ofstream>(d->file_name, std::ios_base::trunc | std::ios_base::out | std::ios_base::binary);
         if (!d->file_stream || !d->file_stream->good()) {
             TGL_ERROR("can not open file [" << d->file_name << "] for writing");
@@ -723,10 +788,18 @@ void transfer_manager::download_part_finished(const std::shared_ptr<download_tas
     }
 
     if (!d->iv.empty()) {
+        auto ua = m_user_agent.lock();
+        if (!ua) {
+            TGL_ERROR("the user agent has gone");
+            d->set_status(tgl_download_status::failed);
+            d->running_parts.clear();
+            download_end(d);
+            return;
+        }
+
         d->running_parts[offset] = download_data(DS_UF->bytes->data, DS_UF->bytes->len, false);
         auto it = d->running_parts.begin();
         for (;it != d->running_parts.end() && d->decryption_offset == it->first && it->second; ++it) {
-            char* data = it->second.data();
             size_t length = it->second.length();
             if (length & 15) {
                 TGL_ERROR("the encrypted data length is not half byte aligned");
@@ -734,18 +807,24 @@ void transfer_manager::download_part_finished(const std::shared_ptr<download_tas
                 d->set_status(tgl_download_status::failed);
                 d->running_parts.clear();
                 download_end(d);
+                return;
             }
-            TGLC_aes_key aes_key;
-            TGLC_aes_set_decrypt_key(d->key.data(), 256, &aes_key);
-            TGLC_aes_ige_encrypt(reinterpret_cast<const unsigned char*>(data),
-                    reinterpret_cast<unsigned char*>(data), length, &aes_key, d->iv.data(), 0);
-            memset(&aes_key, 0, sizeof(aes_key));
-            if (length > d->size - it->first) {
-                length = d->size - it->first;
+
+            // The crypto worker decrypts and writes the part later, so it needs a copy of the
+            // data it doesn't own yet.
+            auto part = std::make_shared<download_data>();
+            if (it->second.owns_data()) {
+                *part = std::move(it->second);
+            } else {
+                *part = download_data(it->second.data(), length, true);
             }
-            d->file_stream->seekp(it->first);
-            d->file_stream->write(data, length);
-            d->decryption_offset += length;
+            size_t write_length = std::min<size_t>(length, d->size - it->first);
+            d->pending_decryptions++;
+            crypto_queue(ua).decrypt_and_write(d->key.data(), d->iv.data(), reinterpret_cast<unsigned char*>(part->data()),
+                    length, d->output, it->first, write_length, [self = shared_from_this(), d, part](bool success) {
+                self->download_part_written(d, success);
+            });
+            d->decryption_offset += write_length;
         }
         if (it == d->running_parts.begin()) {
             d->running_parts[offset] = download_data(DS_UF->bytes->data, DS_UF->bytes->len, true);
@@ -764,17 +843,100 @@ void transfer_manager::download_part_finished(const std::shared_ptr<download_tas
         d->set_status(tgl_download_status::downloading);
     }
 
-    if (d->offset < d->size) {
-        download_part(d);
-    } else if (d->running_parts.empty()) {
+    if (d->offset >= d->size && d->running_parts.empty() && !d->pending_decryptions) {
         download_end(d);
     }
+    schedule_parts();
 }
 
-void transfer_manager::download_multiple_parts(const std::shared_ptr<download_task>& d, size_t count)
+void transfer_manager::download_part_written(const std::shared_ptr<download_task>& d, bool success)
 {
-    for (size_t i = 0; d->offset < d->size && i < count; ++i) {
-        download_part(d);
+    assert(d->pending_decryptions);
+    d->pending_decryptions--;
+
+    // The download may have been cancelled or failed in the meantime.
+    if (!d->output) {
+        return;
+    }
+
+    if (!success) {
+        TGL_ERROR("failed to write to file [" << d->file_name << "]");
+        d->set_status(tgl_download_status::failed);
+        d->running_parts.clear();
+        download_end(d);
+        return;
+    }
+
+    if (d->offset >= d->size && d->running_parts.empty() && !d->pending_decryptions) {
+        download_end(d);
+    }
+}
+
+crypto_work_queue& transfer_manager::crypto_queue(const std::shared_ptr<user_agent>& ua)
+{
+    if (!m_crypto_work_queue) {
+        m_crypto_work_queue = std::make_shared<crypto_work_queue>(ua->timer_factory(),
+                ua->transfer_crypto_threads(), ua->transfer_crypto_post_to_loop());
+    }
+    return *m_crypto_work_queue;
+}
+
+void transfer_manager::schedule_parts()
+{
+    // Starting a part can end a transfer, which schedules again. Let the outer call redo its
+    // round with the freed limit instead of nesting.
+    if (m_scheduling_parts) {
+        m_reschedule_parts = true;
+        return;
+    }
+
+    m_scheduling_parts = true;
+    do {
+        m_reschedule_parts = false;
+        start_parts();
+    } while (m_reschedule_parts);
+    m_scheduling_parts = false;
+}
+
+void transfer_manager::start_parts()
+{
+    size_t bytes_in_flight = 0;
+    std::vector<std::shared_ptr<upload_task>> uploads;
+    std::vector<std::shared_ptr<download_task>> downloads;
+    for (const auto& it: m_uploads) {
+        bytes_in_flight += it.second->window.bytes_in_flight();
+        uploads.push_back(it.second);
+    }
+    for (const auto& it: m_downloads) {
+        bytes_in_flight += it.second->window.bytes_in_flight();
+        downloads.push_back(it.second);
+    }
+
+    // Hand out one part per transfer and round so that the transfers share the global limit
+    // fairly. Starting a part may end its transfer, hence the lookups.
+    bool started = true;
+    while (started) {
+        started = false;
+        for (const auto& u: uploads) {
+            if (bytes_in_flight && bytes_in_flight + MAX_PART_SIZE > m_max_bytes_in_flight) {
+                return;
+            }
+            if (u->part_num * MAX_PART_SIZE < u->size && u->window.can_start() && m_uploads.count(u->message_id)) {
+                upload_part(u);
+                bytes_in_flight += MAX_PART_SIZE;
+                started = true;
+            }
+        }
+        for (const auto& d: downloads) {
+            if (bytes_in_flight && bytes_in_flight + MAX_PART_SIZE > m_max_bytes_in_flight) {
+                return;
+            }
+            if (d->offset < d->size && d->window.can_start() && m_downloads.count(d->id)) {
+                download_part(d);
+                bytes_in_flight += MAX_PART_SIZE;
+                started = true;
+            }
+        }
     }
 }
 
@@ -800,6 +962,7 @@ void transfer_manager::download_part(const std::shared_ptr<download_task>& d)
     }
 
     d->running_parts[d->offset] = download_data();
+    d->window.part_started(d->offset);
 
     auto q = std::make_shared<query_download_file_part>(*ua, d, std::bind(&transfer_manager::download_part_finished,
             shared_from_this(), d, d->offset, std::placeholders::_1));
@@ -860,7 +1023,9 @@ void transfer_manager::download_by_file_location(int64_t download_id,
     if (file_size <= 0) { // It's likely for avatar which doesn't have a file size
         download_part(d);
     } else {
-        download_multiple_parts(d, ua->client_at(d->location.dc())->max_connections());
+        d->window.reset(ua->client_at(d->location.dc())->max_connections() * MAX_PART_SIZE,
+                m_max_bytes_in_flight_per_transfer, MAX_PART_SIZE);
+        schedule_parts();
     }
 }
 
@@ -899,7 +1064,9 @@ void transfer_manager::download_document(int64_t download_id,
         d->ext = tgl_extension_by_mime_type(document->mime_type);
     }
     d->set_status(tgl_download_status::waiting);
-    download_multiple_parts(d, ua->client_at(d->location.dc())->max_connections());
+    d->window.reset(ua->client_at(d->location.dc())->max_connections() * MAX_PART_SIZE,
+            m_max_bytes_in_flight_per_transfer, MAX_PART_SIZE);
+    schedule_parts();
 }
 
 void transfer_manager::cancel_download(int64_t download_id)
@@ -934,5 +1101,13 @@ bool transfer_manager::is_downloading_file(int64_t download_id) const
     return m_downloads.count(download_id);
 }
 
+void transfer_manager::set_max_bytes_in_flight(size_t per_transfer, size_t total)
+{
+    m_max_bytes_in_flight_per_transfer = std::max(per_transfer, MAX_PART_SIZE);
+    m_max_bytes_in_flight = std::max(total, MAX_PART_SIZE);
+    // A raised total limit lets the running transfers start more parts now.
+    schedule_parts();
+}
+
 }
 }
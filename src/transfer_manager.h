@@ -29,6 +29,7 @@
 namespace tgl {
 namespace impl {
 
+class crypto_work_queue;
 class download_task;
 class query_download_file_part;
 class query_upload_file_part;
@@ -39,10 +40,7 @@ struct tl_ds_upload_file;
 class transfer_manager: public std::enable_shared_from_this<transfer_manager>, public tgl_transfer_manager
 {
 public:
-    transfer_manager(const std::weak_ptr<user_agent>& weak_ua, const std::string& download_directory)
-        : m_user_agent(weak_ua)
-        , m_download_directory(download_directory)
-    { }
+    transfer_manager(const std::weak_ptr<user_agent>& weak_ua, const std::string& download_directory);
 
     virtual std::string download_directory() const override { return m_download_directory; }
     virtual bool file_exists(const tgl_file_location &location) const override;
@@ -74,6 +72,7 @@ public:
     virtual void cancel_upload(int64_t message_id) override;
     virtual bool is_uploading_file(int64_t message_id) const override;
     virtual bool is_downloading_file(int64_t download_id) const override;
+    virtual void set_max_bytes_in_flight(size_t per_transfer, size_t total) override;
 
 private:
     void upload_part_finished(const std::shared_ptr<upload_task>&u, size_t part_number, bool success);
@@ -84,7 +83,6 @@ private:
     void upload_encrypted_file_end(const std::shared_ptr<upload_task>&);
     void upload_thumb(const std::shared_ptr<upload_task>&);
 
-    void upload_multiple_parts(const std::shared_ptr<upload_task>& u, size_t count);
     void upload_part(const std::shared_ptr<upload_task>&);
 
     void upload_document(const tgl_input_peer_t& to_id,
@@ -101,15 +99,26 @@ private:
 
     void download_part_finished(const std::shared_ptr<download_task>&, size_t offset, const tl_ds_upload_file*);
 
-    void download_multiple_parts(const std::shared_ptr<download_task>&, size_t count);
     void download_part(const std::shared_ptr<download_task>&);
     void download_end(const std::shared_ptr<download_task>&);
+    void download_part_written(const std::shared_ptr<download_task>&, bool success);
+
+    // Starts parts of the running transfers while their windows and the global limit allow.
+    void schedule_parts();
+    void start_parts();
+
+    crypto_work_queue& crypto_queue(const std::shared_ptr<user_agent>& ua);
 
 private:
     std::weak_ptr<user_agent> m_user_agent;
     std::string m_download_directory;
     std::map<int64_t, std::shared_ptr<download_task>> m_downloads;
     std::map<int64_t, std::shared_ptr<upload_task>> m_uploads;
+    std::shared_ptr<crypto_work_queue> m_crypto_work_queue;
+    size_t m_max_bytes_in_flight_per_transfer;
+    size_t m_max_bytes_in_flight;
+    bool m_scheduling_parts;
+    bool m_reschedule_parts;
 };
 
 static constexpr size_t BIG_FILE_THRESHOLD = 10 * 1024 * 1024;
@@ -0,0 +1,110 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "transfer_window.h"
+
+#include "tools.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace tgl {
+namespace impl {
+
+static constexpr double RTT_SMOOTHING_FACTOR = 0.125;
+// The window is widened while fewer parts than this are queued and narrowed while more are.
+static constexpr double MIN_QUEUED_PARTS = 1;
+static constexpr double MAX_QUEUED_PARTS = 3;
+
+transfer_window::transfer_window()
+    : m_window(0)
+    , m_max_window(0)
+    , m_part_size(0)
+    , m_slow_start_threshold(std::numeric_limits<size_t>::max())
+    , m_bytes_in_flight(0)
+    , m_min_rtt(0)
+    , m_smoothed_rtt(0)
+    , m_next_adjustment_time(0)
+{
+}
+
+void transfer_window::reset(size_t initial_window, size_t max_window, size_t part_size)
+{
+    m_part_size = part_size;
+    m_max_window = std::max(max_window, part_size);
+    m_window = std::max(std::min(initial_window, m_max_window), part_size);
+    m_slow_start_threshold = m_max_window;
+    m_min_rtt = 0;
+    m_smoothed_rtt = 0;
+    m_next_adjustment_time = 0;
+}
+
+void transfer_window::part_started(size_t part_id)
+{
+    m_part_start_times[part_id] = tgl_get_monotonic_time();
+    m_bytes_in_flight += m_part_size;
+}
+
+void transfer_window::part_finished(size_t part_id)
+{
+    auto it = m_part_start_times.find(part_id);
+    if (it == m_part_start_times.end()) {
+        return;
+    }
+
+    double now = tgl_get_monotonic_time();
+    double rtt = now - it->second;
+    m_part_start_times.erase(it);
+    m_bytes_in_flight -= m_part_size;
+
+    if (!m_min_rtt || rtt < m_min_rtt) {
+        m_min_rtt = rtt;
+    }
+    if (!m_smoothed_rtt) {
+        m_smoothed_rtt = rtt;
+    } else {
+        m_smoothed_rtt += RTT_SMOOTHING_FACTOR * (rtt - m_smoothed_rtt);
+    }
+
+    if (now < m_next_adjustment_time || m_smoothed_rtt <= 0) {
+        return;
+    }
+    m_next_adjustment_time = now + m_smoothed_rtt;
+
+    // The difference between the expected (window / min_rtt) and the actual (window / rtt)
+    // throughput, times min_rtt, is how many bytes sit in queues rather than on the wire.
+    double queued_parts = m_window * (1 - m_min_rtt / m_smoothed_rtt) / m_part_size;
+    if (queued_parts > MAX_QUEUED_PARTS) {
+        m_window = std::max(m_window - m_part_size, m_part_size);
+        m_slow_start_threshold = std::min(m_slow_start_threshold, m_window);
+    } else if (queued_parts < MIN_QUEUED_PARTS) {
+        if (m_window < m_slow_start_threshold) {
+            m_window = std::min(m_window * 2, m_slow_start_threshold);
+        } else {
+            m_window += m_part_size;
+        }
+    } else {
+        m_slow_start_threshold = std::min(m_slow_start_threshold, m_window);
+    }
+    m_window = std::min(m_window, m_max_window);
+}
+
+}
+}
@@ -0,0 +1,61 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+
+namespace tgl {
+namespace impl {
+
+// Decides how many bytes of a file's parts may be in flight, like a delay based (Vegas
+// style) congestion window. Once per round trip the throughput the window achieves is
+// compared with what it would achieve at the lowest round trip time seen: the window grows
+// while few parts are queued on the way and shrinks when the queue builds up.
+class transfer_window
+{
+public:
+    transfer_window();
+
+    void reset(size_t initial_window, size_t max_window, size_t part_size);
+
+    // One part is always allowed so that a file never stalls behind its own window.
+    bool can_start() const { return !m_bytes_in_flight || m_bytes_in_flight + m_part_size <= m_window; }
+    size_t bytes_in_flight() const { return m_bytes_in_flight; }
+    size_t window() const { return m_window; }
+
+    void part_started(size_t part_id);
+    void part_finished(size_t part_id);
+
+private:
+    size_t m_window;
+    size_t m_max_window;
+    size_t m_part_size;
+    size_t m_slow_start_threshold;
+    size_t m_bytes_in_flight;
+    double m_min_rtt;
+    double m_smoothed_rtt;
+    double m_next_adjustment_time;
+    std::unordered_map<size_t, double> m_part_start_times;
+};
+
+}
+}
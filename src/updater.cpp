@@ -24,7 +24,6 @@
 #include "auto/auto.h"
 #include "auto/auto_types.h"
 #include "auto/auto_fetch_ds.h"
-#include "auto/auto_free_ds.h"
 #include "chat.h"
 #include "file_location.h"
 #include "message.h"
@@ -268,7 +267,7 @@ void updater::work_update(const tl_ds_update* DS_U, const update_context& contex
     case CODE_update_contact_link:
         break;
     case CODE_update_new_authorization:
-        m_user_agent.callback()->new_authorization(DS_U->device->data, DS_U->location->data);
+        m_user_agent.callback()->new_authorization(DS_STDSTR(DS_U->device), DS_STDSTR(DS_U->location));
         break;
     /*
     case CODE_update_new_geo_chat_message:
@@ -716,14 +715,16 @@ void updater::work_any_updates(const tl_ds_updates* DS_U, const update_context&
 void updater::work_any_updates(tgl_in_buffer* in, const update_context& context)
 {
     paramed_type type = TYPE_TO_PARAM(updates);
+    tl_ds_arena arena;
+    in->arena = &arena;
     tl_ds_updates* DS_U = fetch_ds_type_updates(in, &type);
+    in->arena = nullptr;
     if (!DS_U) {
         TGL_WARNING("failed to fetch updates from response from the server, likely corrupt data");
         return;
     }
 
     work_any_updates(DS_U, context);
-    free_ds_type_updates(DS_U, &type);
 }
 
 void updater::work_encrypted_message(const tl_ds_encrypted_message* DS_EM, const update_context&)
@@ -0,0 +1,84 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "tgl/tgl_transfer_manager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tgl {
+namespace impl {
+
+class file_upload_source: public tgl_upload_source
+{
+public:
+    file_upload_source(int fd, bool owns_fd)
+        : m_fd(fd)
+        , m_owns_fd(owns_fd)
+    { }
+
+    ~file_upload_source()
+    {
+        if (m_owns_fd) {
+            close(m_fd);
+        }
+    }
+
+    virtual int64_t read(uint64_t offset, char* buffer, size_t length) override
+    {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t n = pread(m_fd, buffer + total, length - total, offset + total);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            total += n;
+        }
+        return total;
+    }
+
+private:
+    int m_fd;
+    bool m_owns_fd;
+};
+
+}
+}
+
+std::shared_ptr<tgl_upload_source> tgl_upload_source::from_file(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return std::make_shared<tgl::impl::file_upload_source>(fd, true);
+}
+
+std::shared_ptr<tgl_upload_source> tgl_upload_source::from_descriptor(int fd)
+{
+    return std::make_shared<tgl::impl::file_upload_source>(fd, false);
+}
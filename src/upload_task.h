@@ -23,6 +23,7 @@
 
 #include "tgl/tgl_peer_id.h"
 #include "tgl/tgl_transfer_manager.h"
+#include "transfer_window.h"
 
 #include <array>
 #include <cstdint>
@@ -68,8 +69,10 @@ public:
     tgl_upload_status status;
 
     std::unordered_set<size_t> running_parts;
+    transfer_window window;
     tgl_upload_callback callback;
     tgl_read_callback read_callback;
+    std::shared_ptr<tgl_upload_source> source;
     tgl_upload_part_done_callback part_done_callback;
 
     upload_task();
@@ -105,6 +105,7 @@
 #include "tgl/tgl_unconfirmed_secret_message_storage.h"
 #include "tgl/tgl_update_callback.h"
 #include "tgl/tgl_value.h"
+#include "timer_wheel.h"
 #include "tools.h"
 #include "transfer_manager.h"
 #include "updater.h"
@@ -185,6 +186,13 @@ user_agent::user_agent()
     , m_test_mode(false)
     , m_pfs_enabled(false)
     , m_ipv6_enabled(false)
+    , m_message_batching_enabled(false)
+    , m_message_batching_window(0)
+    , m_min_secondary_connections(0)
+    , m_max_secondary_connections(3)
+    , m_secondary_connection_idle_timeout(15.0)
+    , m_transfer_crypto_threads(0)
+    , m_warm_up_ready_dc_count(0)
     , m_diff_locked(false)
     , m_password_locked(false)
     , m_phone_number_input_locked(false)
@@ -199,12 +207,23 @@ void user_agent::shut_down()
     m_is_started = false;
 
     m_online_status_observers.clear();
+    for (const auto& client: m_clients) {
+        if (client) {
+            client->clear_active_queries();
+        }
+    }
     m_clients.clear();
-    m_active_queries.clear();
     m_retry_queries.clear();
     m_secret_chats.clear();
 }
 
+void user_agent::set_timer_factory(const std::shared_ptr<tgl_timer_factory>& factory)
+{
+    // All library timers share one host timer through the wheel, see timer_wheel for
+    // the resolution they fire at.
+    m_timer_factory = factory ? std::make_shared<timer_wheel>(factory) : nullptr;
+}
+
 void user_agent::set_dc_auth_key(int dc_id, const char* key, size_t key_length)
 {
     if (dc_id <= 0 || dc_id > MAX_DC_ID) {
@@ -267,6 +286,7 @@ void user_agent::set_dc_logged_in(int dc_id, bool logged_in)
     auto client = m_clients[dc_id];
     client->set_logged_in(logged_in);
     m_callback->dc_updated(client.get());
+    warm_up_progress_changed();
 }
 
 void user_agent::set_active_dc(int dc_id)
@@ -442,34 +462,22 @@ std::shared_ptr<secret_chat> user_agent::secret_chat_for_id(int chat_id) const
 
 void user_agent::add_active_query(const std::shared_ptr<query>& q)
 {
-    auto id = q->msg_id();
-    assert(id);
-    auto inserted_iterator_pair = m_active_queries.emplace(id, q);
-    if (inserted_iterator_pair.second) {
-        q->client()->increase_active_queries();
-    } else {
-        inserted_iterator_pair.first->second = q;
-    }
+    assert(q->msg_id());
+    q->client()->add_active_query(q);
 }
 
-std::shared_ptr<query> user_agent::get_active_query(int64_t id) const
+void user_agent::remove_active_query(const std::shared_ptr<query>& q)
 {
-    assert(id);
-    auto it = m_active_queries.find(id);
-    if (it == m_active_queries.end()) {
-        return nullptr;
+    assert(q->msg_id());
+    if (q->client()->remove_active_query(q)) {
+        return;
     }
-    return it->second;
-}
 
-void user_agent::remove_active_query(const std::shared_ptr<query>& q)
-{
-    auto id = q->msg_id();
-    assert(id);
-    auto it = m_active_queries.find(id);
-    if (it != m_active_queries.end()) {
-        m_active_queries.erase(it);
-        q->client()->decrease_active_queries();
+    // The query may have been moved to another DC after it was sent.
+    for (const auto& client: m_clients) {
+        if (client && client != q->client() && client->remove_active_query(q)) {
+            return;
+        }
     }
 }
 
@@ -1982,10 +1990,59 @@ void user_agent::export_all_auth()
     }
 }
 
+void user_agent::set_warm_up_dcs(const std::vector<int32_t>& dc_ids)
+{
+    m_warm_up_dc_ids = std::set<int32_t>(dc_ids.begin(), dc_ids.end());
+    m_warm_up_ready_dc_count = 0;
+    if (m_active_client && m_active_client->is_logged_in()) {
+        warm_up_dcs();
+    }
+}
+
+void user_agent::warm_up_dcs()
+{
+    // Each DC connects and creates its keys in parallel with the authorization export
+    // running on the active DC, so the import can go out as soon as both are done.
+    for (int32_t dc_id: m_warm_up_dc_ids) {
+        auto client = client_at(dc_id);
+        if (!client) {
+            TGL_WARNING("can't warm up unknown DC " << dc_id);
+            continue;
+        }
+        if (!client->session()) {
+            TGL_DEBUG("warming up DC " << dc_id);
+            client->create_session();
+        }
+    }
+    warm_up_progress_changed();
+}
+
+void user_agent::warm_up_progress_changed()
+{
+    if (m_warm_up_dc_ids.empty()) {
+        return;
+    }
+
+    size_t ready_dc_count = 0;
+    for (int32_t dc_id: m_warm_up_dc_ids) {
+        auto client = client_at(dc_id);
+        if (client && client->is_logged_in() && client->is_configured()) {
+            ready_dc_count++;
+        }
+    }
+
+    if (ready_dc_count != m_warm_up_ready_dc_count) {
+        m_warm_up_ready_dc_count = ready_dc_count;
+        TGL_DEBUG(ready_dc_count << " of " << m_warm_up_dc_ids.size() << " DCs warmed up");
+        m_callback->dc_warm_up_progress(ready_dc_count, m_warm_up_dc_ids.size());
+    }
+}
+
 void user_agent::signed_in()
 {
     callback()->logged_in(true);
     export_all_auth();
+    warm_up_dcs();
     if (!is_started()) {
         set_started(true);
         callback()->started();
@@ -28,6 +28,7 @@
 #include "tgl/tgl_user_agent.h"
 #include "tgl/tgl_value.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iostream>
@@ -98,6 +99,24 @@ public:
     virtual bool test_mode() const override { return m_test_mode; }
     virtual void set_pfs_enabled(bool b) override { m_pfs_enabled = b; }
     virtual void set_ipv6_enabled(bool b) override { m_ipv6_enabled = b; }
+    virtual void set_message_batching_enabled(bool enabled, double window_seconds = 0) override
+    {
+        m_message_batching_enabled = enabled;
+        m_message_batching_window = window_seconds;
+    }
+    virtual void set_secondary_connection_limits(size_t min_connections, size_t max_connections, double idle_timeout_seconds) override
+    {
+        m_min_secondary_connections = std::min(min_connections, max_connections);
+        m_max_secondary_connections = max_connections;
+        m_secondary_connection_idle_timeout = idle_timeout_seconds;
+    }
+    virtual void set_transfer_crypto_threads(size_t thread_count,
+            const std::function<void(const std::function<void()>&)>& post_to_loop) override
+    {
+        m_transfer_crypto_threads = thread_count;
+        m_transfer_crypto_post_to_loop = post_to_loop;
+    }
+    virtual void set_warm_up_dcs(const std::vector<int32_t>& dc_ids) override;
 
     virtual void reset_authorization() override;
     virtual void add_rsa_key(const std::string& key) override;
@@ -111,10 +130,11 @@ public:
 
     virtual void set_connection_factory(const std::shared_ptr<tgl_connection_factory>& factory) override { m_connection_factory = factory; }
 
-    virtual void set_timer_factory(const std::shared_ptr<tgl_timer_factory>& factory) override { m_timer_factory = factory; }
+    virtual void set_timer_factory(const std::shared_ptr<tgl_timer_factory>& factory) override;
 
     virtual tgl_transfer_manager* transfer_manager() const override { return m_transfer_manager.get(); }
     virtual void set_unconfirmed_secret_message_storage(const std::shared_ptr<tgl_unconfirmed_secret_message_storage>& storage) override;
+    virtual void set_dc_key_storage(const std::shared_ptr<tgl_dc_key_storage>& storage) override { m_dc_key_storage = storage; }
     virtual int32_t create_secret_chat_id() const override;
 
     virtual std::shared_ptr<tgl_secret_chat> load_secret_chat(int32_t chat_id, int64_t access_hash, int32_t user_id,
@@ -269,11 +289,21 @@ public:
 
     bool pfs_enabled() const { return m_pfs_enabled; }
     bool ipv6_enabled() const { return m_ipv6_enabled; }
+    bool message_batching_enabled() const { return m_message_batching_enabled; }
+    double message_batching_window() const { return m_message_batching_window; }
+    size_t min_secondary_connections() const { return m_min_secondary_connections; }
+    size_t max_secondary_connections() const { return m_max_secondary_connections; }
+    double secondary_connection_idle_timeout() const { return m_secondary_connection_idle_timeout; }
+    size_t transfer_crypto_threads() const { return m_transfer_crypto_threads; }
+    const std::function<void(const std::function<void()>&)>& transfer_crypto_post_to_loop() const { return m_transfer_crypto_post_to_loop; }
+    bool is_warm_up_dc(int32_t dc_id) const { return m_warm_up_dc_ids.count(dc_id) > 0; }
+    void warm_up_progress_changed();
 
     const std::shared_ptr<tgl_update_callback>& callback() const { return m_callback; }
     const std::shared_ptr<tgl_connection_factory>& connection_factory() const { return m_connection_factory; }
     const std::shared_ptr<tgl_timer_factory>& timer_factory() const { return m_timer_factory; }
     const std::shared_ptr<tgl_unconfirmed_secret_message_storage> unconfirmed_secret_message_storage() const;
+    const std::shared_ptr<tgl_dc_key_storage>& dc_key_storage() const { return m_dc_key_storage; }
 
     bool is_started() const { return m_is_started; }
     void set_started(bool b) { m_is_started = b; }
@@ -299,7 +329,6 @@ public:
     const std::map<int32_t, std::shared_ptr<secret_chat>>& secret_chats() const { return m_secret_chats; }
 
     void add_active_query(const std::shared_ptr<query>& q);
-    std::shared_ptr<query> get_active_query(int64_t id) const;
     void remove_active_query(const std::shared_ptr<query>& q);
 
     void add_retry_query(const std::shared_ptr<query>& q);
@@ -331,6 +360,7 @@ private:
     void sign_in();
     void signed_in();
     void export_all_auth();
+    void warm_up_dcs();
     void sign_in_code(const std::shared_ptr<login_context>& context);;
     void register_me(const std::shared_ptr<login_context>& context);
     void sign_in_phone(const std::shared_ptr<login_context>& context);
@@ -367,6 +397,15 @@ private:
     bool m_test_mode;
     bool m_pfs_enabled;
     bool m_ipv6_enabled;
+    bool m_message_batching_enabled;
+    double m_message_batching_window;
+    size_t m_min_secondary_connections;
+    size_t m_max_secondary_connections;
+    double m_secondary_connection_idle_timeout;
+    size_t m_transfer_crypto_threads;
+    std::function<void(const std::function<void()>&)> m_transfer_crypto_post_to_loop;
+    std::set<int32_t> m_warm_up_dc_ids;
+    size_t m_warm_up_ready_dc_count;
     bool m_diff_locked;
     bool m_password_locked;
     bool m_phone_number_input_locked;
@@ -385,6 +424,7 @@ private:
     std::shared_ptr<tgl_connection_factory> m_connection_factory;
     std::shared_ptr<tgl_update_callback> m_callback;
     std::shared_ptr<tgl_unconfirmed_secret_message_storage> m_unconfirmed_secret_message_storage;
+    std::shared_ptr<tgl_dc_key_storage> m_dc_key_storage;
     std::shared_ptr<mtproto_client> m_active_client;
     std::shared_ptr<tgl_timer> m_state_lookup_timer;
 
@@ -394,7 +434,6 @@ private:
     std::vector<std::shared_ptr<mtproto_client>> m_clients;
     std::vector<std::shared_ptr<rsa_public_key>> m_rsa_keys;
     std::map<int32_t/*peer id*/, std::shared_ptr<secret_chat>> m_secret_chats;
-    std::map<int64_t/*msg_id*/, std::shared_ptr<query>> m_active_queries;
     std::set<std::shared_ptr<query>> m_retry_queries;
     std::set<std::weak_ptr<tgl_online_status_observer>, std::owner_less<std::weak_ptr<tgl_online_status_observer>>> m_online_status_observers;
 };
@@ -0,0 +1,55 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#pragma once
+
+#include <iostream>
+
+// The unit tests are plain executables run by ctest. A failed check is reported and
+// makes the test exit with a non-zero status.
+
+namespace tgl {
+namespace test {
+
+inline int& failed_checks()
+{
+    static int count = 0;
+    return count;
+}
+
+inline int result()
+{
+    if (failed_checks()) {
+        std::cerr << failed_checks() << " checks failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+}
+}
+
+#define TEST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++tgl::test::failed_checks(); \
+        } \
+    } while (false)
@@ -0,0 +1,237 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "crypto/crypto_aes.h"
+#include "crypto/crypto_aes_ige.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks aes_ige_key against OpenSSL's IGE implementation. Run with "benchmark" to also
+// compare their speed.
+
+using namespace tgl::impl;
+
+namespace {
+
+std::mt19937 g_random(42);
+
+std::vector<unsigned char> random_bytes(size_t length)
+{
+    std::vector<unsigned char> bytes(length);
+    for (auto& byte: bytes) {
+        byte = static_cast<unsigned char>(g_random());
+    }
+    return bytes;
+}
+
+struct reference_stream
+{
+    std::vector<unsigned char> key;
+    std::vector<unsigned char> iv;
+    std::vector<unsigned char> data;
+    bool encrypt;
+
+    reference_stream(size_t length, bool encrypt)
+        : key(random_bytes(32))
+        , iv(random_bytes(32))
+        , data(random_bytes(length))
+        , encrypt(encrypt)
+    { }
+
+    // Runs the stream through OpenSSL and returns the output and the updated iv.
+    std::pair<std::vector<unsigned char>, std::vector<unsigned char>> expected() const
+    {
+        TGLC_aes_key openssl_key;
+        if (encrypt) {
+            TGLC_aes_set_encrypt_key(key.data(), 256, &openssl_key);
+        } else {
+            TGLC_aes_set_decrypt_key(key.data(), 256, &openssl_key);
+        }
+        std::vector<unsigned char> out(data.size());
+        std::vector<unsigned char> updated_iv = iv;
+        TGLC_aes_ige_encrypt(data.data(), out.data(), data.size(), &openssl_key, updated_iv.data(), encrypt ? 1 : 0);
+        return std::make_pair(out, updated_iv);
+    }
+
+    void set_key(aes_ige_key& ige_key) const
+    {
+        if (encrypt) {
+            ige_key.set_encrypt_key(key.data());
+        } else {
+            ige_key.set_decrypt_key(key.data());
+        }
+    }
+};
+
+}
+
+static void test_process()
+{
+    for (bool encrypt: { true, false }) {
+        for (size_t length: { 16, 32, 48, 1024, 4096 + 16 }) {
+            reference_stream stream(length, encrypt);
+            auto expected = stream.expected();
+            aes_ige_key key;
+            stream.set_key(key);
+
+            std::vector<unsigned char> out(length);
+            std::vector<unsigned char> iv = stream.iv;
+            key.process(stream.data.data(), out.data(), length, iv.data());
+            TEST_CHECK(out == expected.first);
+            TEST_CHECK(iv == expected.second);
+
+            // In place, and in pieces carrying the iv over.
+            std::vector<unsigned char> data = stream.data;
+            iv = stream.iv;
+            size_t first_piece = (length / 32) * 16;
+            key.process(data.data(), data.data(), first_piece, iv.data());
+            key.process(data.data() + first_piece, data.data() + first_piece, length - first_piece, iv.data());
+            TEST_CHECK(data == expected.first);
+            TEST_CHECK(iv == expected.second);
+
+            // Into the same buffer a few bytes before the input.
+            std::vector<unsigned char> buffer(length + 3);
+            memcpy(buffer.data() + 3, stream.data.data(), length);
+            iv = stream.iv;
+            key.process(buffer.data() + 3, buffer.data(), length, iv.data());
+            TEST_CHECK(std::equal(expected.first.begin(), expected.first.end(), buffer.begin()));
+            TEST_CHECK(iv == expected.second);
+        }
+    }
+}
+
+static void test_process_interleaved()
+{
+    // More streams than are interleaved at once, of different lengths and directions.
+    for (size_t count = 1; count <= 2 * aes_ige_key::MAX_INTERLEAVED_STREAMS + 1; ++count) {
+        std::vector<reference_stream> streams;
+        for (size_t i = 0; i < count; ++i) {
+            streams.emplace_back(16 * (1 + g_random() % 300), i % 3 != 2);
+        }
+
+        std::vector<aes_ige_key> keys(count);
+        std::vector<aes_ige_job> jobs;
+        std::vector<std::vector<unsigned char>> data;
+        std::vector<std::vector<unsigned char>> ivs;
+        data.reserve(count);
+        ivs.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            streams[i].set_key(keys[i]);
+            data.push_back(streams[i].data);
+            ivs.push_back(streams[i].iv);
+            jobs.push_back({ &keys[i], data[i].data(), data[i].size(), ivs[i].data() });
+        }
+
+        aes_ige_key::process_interleaved(jobs.data(), jobs.size());
+
+        bool all_match = true;
+        for (size_t i = 0; i < count; ++i) {
+            auto expected = streams[i].expected();
+            all_match = all_match && data[i] == expected.first && ivs[i] == expected.second;
+        }
+        TEST_CHECK(all_match);
+    }
+}
+
+template<typename F>
+static double megabytes_per_second(size_t bytes, F&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return bytes / elapsed.count() / (1024 * 1024);
+}
+
+static void benchmark()
+{
+    static constexpr size_t PART_SIZE = 512 * 1024;
+    static constexpr size_t ROUNDS = 64;
+    static constexpr size_t STREAMS = aes_ige_key::MAX_INTERLEAVED_STREAMS;
+
+    std::vector<unsigned char> key_bytes = random_bytes(32);
+    std::vector<std::vector<unsigned char>> data;
+    std::vector<std::vector<unsigned char>> ivs;
+    for (size_t i = 0; i < STREAMS; ++i) {
+        data.push_back(random_bytes(PART_SIZE));
+        ivs.push_back(random_bytes(32));
+    }
+    size_t total = ROUNDS * STREAMS * PART_SIZE;
+
+    std::cout << "AES-NI: " << (aes_ige_key::hardware_accelerated() ? "yes" : "no") << std::endl;
+
+    for (bool encrypt: { true, false }) {
+        TGLC_aes_key openssl_key;
+        aes_ige_key key;
+        if (encrypt) {
+            TGLC_aes_set_encrypt_key(key_bytes.data(), 256, &openssl_key);
+            key.set_encrypt_key(key_bytes.data());
+        } else {
+            TGLC_aes_set_decrypt_key(key_bytes.data(), 256, &openssl_key);
+            key.set_decrypt_key(key_bytes.data());
+        }
+
+        double openssl_speed = megabytes_per_second(total, [&] {
+            for (size_t round = 0; round < ROUNDS; ++round) {
+                for (size_t i = 0; i < STREAMS; ++i) {
+                    TGLC_aes_ige_encrypt(data[i].data(), data[i].data(), PART_SIZE, &openssl_key, ivs[i].data(), encrypt ? 1 : 0);
+                }
+            }
+        });
+        double process_speed = megabytes_per_second(total, [&] {
+            for (size_t round = 0; round < ROUNDS; ++round) {
+                for (size_t i = 0; i < STREAMS; ++i) {
+                    key.process(data[i].data(), data[i].data(), PART_SIZE, ivs[i].data());
+                }
+            }
+        });
+        double interleaved_speed = megabytes_per_second(total, [&] {
+            std::vector<aes_ige_job> jobs;
+            for (size_t i = 0; i < STREAMS; ++i) {
+                jobs.push_back({ &key, data[i].data(), PART_SIZE, ivs[i].data() });
+            }
+            for (size_t round = 0; round < ROUNDS; ++round) {
+                aes_ige_key::process_interleaved(jobs.data(), jobs.size());
+            }
+        });
+
+        std::cout << (encrypt ? "encrypt" : "decrypt")
+                << ": TGLC_aes_ige_encrypt " << openssl_speed << " MB/s"
+                << ", process " << process_speed << " MB/s"
+                << ", process_interleaved " << interleaved_speed << " MB/s" << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    test_process();
+    test_process_interleaved();
+    if (argc > 1 && std::string(argv[1]) == "benchmark") {
+        benchmark();
+    }
+    return tgl::test::result();
+}
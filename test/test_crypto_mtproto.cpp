@@ -0,0 +1,112 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "crypto/crypto_mtproto.h"
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace tgl::impl;
+
+static constexpr int MESSAGE_HEADER_SIZE = 32;
+static constexpr int MESSAGE_LENGTH_OFFSET = 28;
+
+namespace {
+
+std::mt19937 g_random(42);
+
+struct encrypted_test_message
+{
+    std::vector<unsigned char> plaintext;
+    std::vector<unsigned char> ciphertext;
+    unsigned char msg_key[16];
+};
+
+encrypted_test_message encrypt(const unsigned char* auth_key, int32_t msg_len)
+{
+    encrypted_test_message message;
+    message.plaintext.resize(MESSAGE_HEADER_SIZE + msg_len);
+    for (auto& byte: message.plaintext) {
+        byte = static_cast<unsigned char>(g_random());
+    }
+    memcpy(message.plaintext.data() + MESSAGE_LENGTH_OFFSET, &msg_len, 4);
+
+    message.ciphertext = message.plaintext;
+    message.ciphertext.resize(message.plaintext.size() + 16);
+    int length = TGLC_mtproto_encrypt_message(auth_key, message.ciphertext.data(),
+            message.plaintext.size(), message.ciphertext.size(), message.msg_key);
+    message.ciphertext.resize(length);
+    return message;
+}
+
+}
+
+static void test_round_trip()
+{
+    unsigned char auth_key[256];
+    for (auto& byte: auth_key) {
+        byte = static_cast<unsigned char>(g_random());
+    }
+
+    // Messages both shorter and longer than a decryption chunk.
+    for (int32_t msg_len: { 4, 100, 10000 }) {
+        encrypted_test_message message = encrypt(auth_key, msg_len);
+        int length = message.ciphertext.size();
+
+        // In place.
+        std::vector<unsigned char> data = message.ciphertext;
+        TEST_CHECK(TGLC_mtproto_decrypt_message(auth_key, message.msg_key, data.data(), data.data(), length) == length);
+        TEST_CHECK(!memcmp(data.data(), message.plaintext.data(), message.plaintext.size()));
+
+        // Moved back into alignment while decrypting, as for a frame after a one byte prefix.
+        for (int misalignment = 1; misalignment < 4; ++misalignment) {
+            std::vector<unsigned char> buffer(length + misalignment);
+            memcpy(buffer.data() + misalignment, message.ciphertext.data(), length);
+            TEST_CHECK(TGLC_mtproto_decrypt_message(auth_key, message.msg_key,
+                    buffer.data() + misalignment, buffer.data(), length) == length);
+            TEST_CHECK(!memcmp(buffer.data(), message.plaintext.data(), message.plaintext.size()));
+        }
+
+        // A damaged message doesn't match its message key.
+        data = message.ciphertext;
+        data[length - 1] ^= 1;
+        TEST_CHECK(TGLC_mtproto_decrypt_message(auth_key, message.msg_key, data.data(), data.data(), length) == -1);
+    }
+}
+
+static void test_malformed_length()
+{
+    unsigned char auth_key[256] = {};
+    unsigned char msg_key[16] = {};
+    std::vector<unsigned char> data(MESSAGE_HEADER_SIZE + 8);
+    TEST_CHECK(TGLC_mtproto_decrypt_message(auth_key, msg_key, data.data(), data.data(), 16) == -1);
+    TEST_CHECK(TGLC_mtproto_decrypt_message(auth_key, msg_key, data.data(), data.data(), MESSAGE_HEADER_SIZE + 4) == -1);
+}
+
+int main()
+{
+    test_round_trip();
+    test_malformed_length();
+    return tgl::test::result();
+}
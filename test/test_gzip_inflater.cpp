@@ -0,0 +1,116 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "gzip_inflater.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+using namespace tgl::impl;
+
+static std::string gzip(const std::string& data)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    std::string output(deflateBound(&stream, data.size()) + 32, '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.size();
+    deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return output;
+}
+
+static std::string make_payload(size_t size)
+{
+    std::string payload(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        payload[i] = static_cast<char>((i * 7) % 251);
+    }
+    return payload;
+}
+
+static bool inflates_to(gzip_inflater& inflater, const std::string& payload)
+{
+    std::string packed = gzip(payload);
+    std::vector<int32_t> output = inflater.acquire_buffer();
+    int size = inflater.inflate(packed.data(), packed.size(), output);
+    bool ok = size == static_cast<int>(payload.size())
+            && output.size() * 4 >= payload.size()
+            && !memcmp(output.data(), payload.data(), payload.size());
+    inflater.release_buffer(std::move(output));
+    return ok;
+}
+
+static void test_round_trip()
+{
+    gzip_inflater inflater;
+    // The same inflater is reused for payloads of different sizes, including ones
+    // that aren't a multiple of four bytes.
+    TEST_CHECK(inflates_to(inflater, make_payload(1)));
+    TEST_CHECK(inflates_to(inflater, make_payload(4000)));
+    TEST_CHECK(inflates_to(inflater, make_payload(1001)));
+    TEST_CHECK(inflates_to(inflater, make_payload(3 * 1024 * 1024)));
+    TEST_CHECK(inflates_to(inflater, std::string(100000, 'a')));
+}
+
+static void test_buffer_is_retained()
+{
+    gzip_inflater inflater;
+    TEST_CHECK(inflates_to(inflater, make_payload(10000)));
+    std::vector<int32_t> buffer = inflater.acquire_buffer();
+    TEST_CHECK(buffer.capacity() * 4 >= 10000);
+    // While the buffer is out, the inflater hands out an empty one.
+    TEST_CHECK(inflater.acquire_buffer().capacity() == 0);
+    inflater.release_buffer(std::move(buffer));
+}
+
+static void test_bad_input()
+{
+    gzip_inflater inflater;
+    std::vector<int32_t> output;
+
+    TEST_CHECK(inflater.inflate("short", 5, output) == -1);
+
+    std::string garbage(100, 'x');
+    TEST_CHECK(inflater.inflate(garbage.data(), garbage.size(), output) == -1);
+
+    std::string packed = gzip(make_payload(5000));
+    std::string truncated = packed.substr(0, packed.size() / 2) + packed.substr(packed.size() - 8);
+    TEST_CHECK(inflater.inflate(truncated.data(), truncated.size(), output) == -1);
+
+    // A failed payload doesn't break the next one.
+    TEST_CHECK(inflates_to(inflater, make_payload(5000)));
+}
+
+int main()
+{
+    test_round_trip();
+    test_buffer_is_retained();
+    test_bad_input();
+    return tgl::test::result();
+}
@@ -0,0 +1,137 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "msg_id_map.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+
+using namespace tgl::impl;
+
+static bool matches(const msg_id_map<int>& map, const std::map<int64_t, int>& expected)
+{
+    if (map.size() != expected.size()) {
+        return false;
+    }
+    for (const auto& it: expected) {
+        const int* value = map.find(it.first);
+        if (!value || *value != it.second) {
+            return false;
+        }
+    }
+    size_t visited = 0;
+    bool all_expected = true;
+    map.for_each([&](int64_t msg_id, int value) {
+        ++visited;
+        auto it = expected.find(msg_id);
+        all_expected = all_expected && it != expected.end() && it->second == value;
+    });
+    return all_expected && visited == expected.size();
+}
+
+static void test_basic_operations()
+{
+    msg_id_map<int> map;
+    TEST_CHECK(map.empty());
+    TEST_CHECK(!map.find(4));
+    TEST_CHECK(!map.erase(4));
+
+    TEST_CHECK(map.insert_or_assign(4, 1));
+    TEST_CHECK(!map.insert_or_assign(4, 2));
+    TEST_CHECK(map.size() == 1);
+    TEST_CHECK(map.find(4) && *map.find(4) == 2);
+
+    TEST_CHECK(map.erase(4));
+    TEST_CHECK(map.empty());
+    TEST_CHECK(!map.find(4));
+
+    map.insert_or_assign(8, 1);
+    map.clear();
+    TEST_CHECK(map.empty());
+    TEST_CHECK(!map.find(8));
+}
+
+static void test_against_std_map()
+{
+    // msg_ids are nearly sequential multiples of 4 derived from the time, which is the
+    // case the hashing is meant for; random ids exercise the probing and erase shifts.
+    std::mt19937_64 random(42);
+    msg_id_map<int> map;
+    std::map<int64_t, int> expected;
+    int64_t base = static_cast<int64_t>(1500000000) << 32;
+
+    bool consistent = true;
+    for (int i = 0; i < 200000 && consistent; ++i) {
+        int64_t msg_id = (random() % 4) ? base + static_cast<int64_t>(random() % 4096) * 4
+                                         : static_cast<int64_t>(random() | 1);
+        switch (random() % 3) {
+        case 0:
+        case 1: {
+            bool inserted = expected.find(msg_id) == expected.end();
+            expected[msg_id] = i;
+            consistent = map.insert_or_assign(msg_id, i) == inserted;
+            break;
+        }
+        case 2:
+            consistent = map.erase(msg_id) == (expected.erase(msg_id) != 0);
+            break;
+        }
+        if (i % 10000 == 0) {
+            consistent = consistent && matches(map, expected);
+        }
+    }
+    TEST_CHECK(consistent);
+    TEST_CHECK(matches(map, expected));
+
+    for (auto it = expected.begin(); it != expected.end();) {
+        TEST_CHECK(map.erase(it->first));
+        it = expected.erase(it);
+    }
+    TEST_CHECK(map.empty());
+}
+
+static void test_move_only_values()
+{
+    msg_id_map<std::unique_ptr<int>> map;
+    for (int64_t i = 1; i <= 100; ++i) {
+        map.insert_or_assign(i * 4, std::unique_ptr<int>(new int(static_cast<int>(i))));
+    }
+    for (int64_t i = 1; i <= 100; i += 2) {
+        map.erase(i * 4);
+    }
+    bool intact = map.size() == 50;
+    for (int64_t i = 2; i <= 100; i += 2) {
+        auto value = map.find(i * 4);
+        intact = intact && value && **value == i;
+    }
+    TEST_CHECK(intact);
+}
+
+int main()
+{
+    test_basic_operations();
+    test_against_std_map();
+    test_move_only_values();
+    return tgl::test::result();
+}
@@ -0,0 +1,277 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace tgl::impl;
+
+namespace {
+
+// The wheel's clock, moved forward by the tests.
+std::chrono::steady_clock::time_point g_now;
+
+std::chrono::steady_clock::time_point now()
+{
+    return g_now;
+}
+
+void pass_ms(int ms)
+{
+    g_now += std::chrono::milliseconds(ms);
+}
+
+// Stands in for the host's timer: the test fires it by hand.
+class host_timer : public tgl_timer
+{
+public:
+    explicit host_timer(const std::function<void()>& cb) : m_cb(cb), m_armed(false), m_delay(-1) { }
+
+    virtual void start(double seconds_from_now) override
+    {
+        m_armed = true;
+        m_delay = seconds_from_now;
+        m_due = g_now + std::chrono::microseconds(static_cast<int64_t>(std::ceil(seconds_from_now * 1e6)));
+    }
+
+    virtual void cancel() override { m_armed = false; }
+
+    void fire()
+    {
+        m_armed = false;
+        m_cb();
+    }
+
+    // Fires as the host would once its clock reaches the time the timer is due.
+    void wait_and_fire()
+    {
+        g_now = std::max(g_now, m_due);
+        fire();
+    }
+
+    void fire_if_due()
+    {
+        while (m_armed && m_due <= g_now) {
+            fire();
+        }
+    }
+
+    bool armed() const { return m_armed; }
+    double delay() const { return m_delay; }
+
+private:
+    std::function<void()> m_cb;
+    bool m_armed;
+    double m_delay;
+    std::chrono::steady_clock::time_point m_due;
+};
+
+class host_timer_factory : public tgl_timer_factory
+{
+public:
+    virtual std::shared_ptr<tgl_timer> create_timer(const std::function<void()>& cb) override
+    {
+        m_timer = std::make_shared<host_timer>(cb);
+        return m_timer;
+    }
+
+    std::shared_ptr<host_timer> m_timer;
+};
+
+std::shared_ptr<timer_wheel> make_wheel(const std::shared_ptr<host_timer_factory>& host)
+{
+    return std::make_shared<timer_wheel>(host, now);
+}
+
+}
+
+static void test_immediate_timer()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    int fired = 0;
+    auto timer = wheel->create_timer([&] { ++fired; });
+    timer->start(0);
+    TEST_CHECK(host->m_timer && host->m_timer->armed());
+    TEST_CHECK(host->m_timer->delay() == 0);
+    host->m_timer->fire();
+    TEST_CHECK(fired == 1);
+    TEST_CHECK(!host->m_timer->armed());
+}
+
+static void test_long_timer_arms_host_once()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    auto timer = wheel->create_timer([] { });
+    timer->start(3 * 3600);
+    // The host sleeps until the timer is due instead of waking up every level wrap.
+    TEST_CHECK(host->m_timer->armed());
+    TEST_CHECK(host->m_timer->delay() > 3 * 3600 - 1);
+    // Cancelling leaves the host timer armed; when it fires there's nothing left to arm it for.
+    timer->cancel();
+    host->m_timer->fire();
+    TEST_CHECK(!host->m_timer->armed());
+}
+
+static void test_timers_fire_in_order()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    std::vector<int> order;
+    auto late = wheel->create_timer([&] { order.push_back(2); });
+    auto early = wheel->create_timer([&] { order.push_back(1); });
+    auto cancelled = wheel->create_timer([&] { order.push_back(3); });
+    late->start(0.06);
+    early->start(0.02);
+    cancelled->start(0.04);
+    cancelled->cancel();
+    TEST_CHECK(host->m_timer->delay() <= 0.03);
+
+    pass_ms(30);
+    host->m_timer->fire();
+    TEST_CHECK(order == std::vector<int>({1}));
+    TEST_CHECK(host->m_timer->armed());
+
+    pass_ms(40);
+    host->m_timer->fire();
+    TEST_CHECK(order == std::vector<int>({1, 2}));
+    TEST_CHECK(!host->m_timer->armed());
+}
+
+static void test_restart_from_callback()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    int fired = 0;
+    std::shared_ptr<tgl_timer> timer;
+    timer = wheel->create_timer([&] {
+        if (++fired < 3) {
+            timer->start(0);
+        }
+    });
+    timer->start(0);
+    for (int i = 0; i < 5 && host->m_timer->armed(); ++i) {
+        host->m_timer->fire();
+    }
+    TEST_CHECK(fired == 3);
+    timer.reset();
+}
+
+static void test_long_timer_fires_after_one_wake_up()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    int fired = 0;
+    auto timer = wheel->create_timer([&] { ++fired; });
+    timer->start(3 * 3600);
+    host->m_timer->wait_and_fire();
+    TEST_CHECK(fired == 1);
+    TEST_CHECK(!host->m_timer->armed());
+}
+
+// Runs the host timer as the host would and checks that every timer fires when it's due,
+// across all levels of the wheel and with timers cancelled on the way.
+static void test_many_timers_fire_on_time()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    std::mt19937 random(42);
+
+    static constexpr size_t COUNT = 5000;
+    std::vector<std::shared_ptr<tgl_timer>> timers;
+    std::vector<double> due_times(COUNT);
+    std::vector<double> fire_times(COUNT, -1);
+    auto elapsed = [] {
+        static const auto start = g_now;
+        return std::chrono::duration<double>(g_now - start).count();
+    };
+    elapsed();
+    for (size_t i = 0; i < COUNT; ++i) {
+        timers.push_back(wheel->create_timer([&, i] { fire_times[i] = elapsed(); }));
+        // From a tick to about a week ahead, spread over the levels.
+        double delay = std::pow(10.0, -2 + static_cast<double>(random() % 7800) / 1000);
+        due_times[i] = elapsed() + delay;
+        timers[i]->start(delay);
+        pass_ms(random() % 3);
+        host->m_timer->fire_if_due();
+    }
+    // Cancel every tenth timer that hasn't fired yet.
+    std::vector<bool> cancelled(COUNT, false);
+    for (size_t i = 0; i < COUNT; i += 10) {
+        if (fire_times[i] < 0) {
+            timers[i]->cancel();
+            cancelled[i] = true;
+        }
+    }
+
+    int wake_ups = 0;
+    while (host->m_timer->armed() && wake_ups < 100000) {
+        host->m_timer->wait_and_fire();
+        ++wake_ups;
+    }
+
+    // A tick late at most, plus up to 2 ms for timers the setup loop above fired.
+    bool on_time = true;
+    for (size_t i = 0; i < COUNT; ++i) {
+        if (cancelled[i]) {
+            on_time = on_time && fire_times[i] < 0;
+        } else {
+            on_time = on_time && fire_times[i] >= due_times[i] - 1e-9 && fire_times[i] <= due_times[i] + 0.013;
+        }
+    }
+    TEST_CHECK(on_time);
+    TEST_CHECK(!host->m_timer->armed());
+}
+
+static void test_destroyed_timer_does_not_fire()
+{
+    auto host = std::make_shared<host_timer_factory>();
+    auto wheel = make_wheel(host);
+    int fired = 0;
+    auto timer = wheel->create_timer([&] { ++fired; });
+    timer->start(0.01);
+    timer.reset();
+    pass_ms(20);
+    if (host->m_timer->armed()) {
+        host->m_timer->fire();
+    }
+    TEST_CHECK(fired == 0);
+}
+
+int main()
+{
+    test_immediate_timer();
+    test_long_timer_arms_host_once();
+    test_timers_fire_in_order();
+    test_restart_from_callback();
+    test_long_timer_fires_after_one_wake_up();
+    test_many_timers_fire_on_time();
+    test_destroyed_timer_does_not_fire();
+    return tgl::test::result();
+}
@@ -0,0 +1,124 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "tl_ds_arena.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace tgl::impl;
+
+static bool is_aligned(const void* p)
+{
+    return !(reinterpret_cast<uintptr_t>(p) % alignof(std::max_align_t));
+}
+
+static void test_alignment_and_no_overlap()
+{
+    tl_ds_arena arena;
+    std::vector<std::pair<char*, size_t>> blocks;
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t size = 1 + (i * 37) % 300;
+        char* p = static_cast<char*>(arena.allocate(size));
+        TEST_CHECK(is_aligned(p));
+        memset(p, static_cast<int>(i & 0xff), size);
+        blocks.emplace_back(p, size);
+    }
+
+    // Every block still holds its own pattern, so none of them overlap.
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        bool intact = true;
+        for (size_t j = 0; j < blocks[i].second; ++j) {
+            intact = intact && blocks[i].first[j] == static_cast<char>(i & 0xff);
+        }
+        TEST_CHECK(intact);
+    }
+}
+
+static void test_big_allocation_keeps_current_chunk()
+{
+    tl_ds_arena arena;
+    char* small1 = static_cast<char*>(arena.allocate(16));
+    char* big = static_cast<char*>(arena.allocate(512 * 1024));
+    char* small2 = static_cast<char*>(arena.allocate(16));
+    TEST_CHECK(big);
+    // The small allocations continue in the first chunk after the big one got its own.
+    TEST_CHECK(small2 == small1 + 16 || small2 == small1 + alignof(std::max_align_t));
+    memset(big, 1, 512 * 1024);
+}
+
+static void test_reset_reuses_first_chunk()
+{
+    tl_ds_arena arena;
+    char* first = static_cast<char*>(arena.allocate(100));
+    for (int i = 0; i < 100; ++i) {
+        arena.allocate(4096);
+    }
+    size_t grown = arena.allocated_bytes();
+    arena.reset();
+    TEST_CHECK(arena.allocated_bytes() < grown);
+    TEST_CHECK(arena.allocate(100) == first);
+}
+
+static void test_reset_restarts_chunk_growth()
+{
+    tl_ds_arena arena;
+    for (int i = 0; i < 1000; ++i) {
+        arena.allocate(4096);
+    }
+    arena.reset();
+    size_t retained = arena.allocated_bytes();
+
+    // The chunks allocated after a reset grow from the initial size again.
+    for (int i = 0; i < 8; ++i) {
+        arena.allocate(4096);
+    }
+    TEST_CHECK(arena.allocated_bytes() - retained <= 64 * 1024);
+}
+
+static void test_reset_drops_dedicated_first_chunk()
+{
+    tl_ds_arena arena;
+    arena.allocate(512 * 1024);
+    arena.allocate(16);
+    arena.reset();
+    TEST_CHECK(arena.allocated_bytes() == 0);
+    TEST_CHECK(arena.allocate(16));
+}
+
+static void test_string_views_flag()
+{
+    TEST_CHECK(!tl_ds_arena().string_views());
+    TEST_CHECK(tl_ds_arena(true).string_views());
+}
+
+int main()
+{
+    test_alignment_and_no_overlap();
+    test_big_allocation_keeps_current_chunk();
+    test_reset_reuses_first_chunk();
+    test_reset_restarts_chunk_growth();
+    test_reset_drops_dedicated_first_chunk();
+    test_string_views_flag();
+    return tgl::test::result();
+}
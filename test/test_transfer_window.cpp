@@ -0,0 +1,107 @@
+/*
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Topology LP 2016-2017
+*/
+
+#include "test.h"
+
+#include "transfer_window.h"
+
+#include <chrono>
+#include <thread>
+
+using namespace tgl::impl;
+
+static constexpr size_t PART_SIZE = 1000;
+
+// Starts as many parts as the window allows and finishes all of them after rtt_ms.
+static void round_trip(transfer_window& window, size_t& next_part_id, int rtt_ms)
+{
+    size_t first_part_id = next_part_id;
+    while (window.can_start()) {
+        window.part_started(next_part_id++);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(rtt_ms));
+    for (size_t part_id = first_part_id; part_id < next_part_id; ++part_id) {
+        window.part_finished(part_id);
+    }
+}
+
+static void test_reset_limits()
+{
+    transfer_window window;
+    window.reset(0, 0, PART_SIZE);
+    TEST_CHECK(window.window() == PART_SIZE);
+
+    window.reset(10 * PART_SIZE, 4 * PART_SIZE, PART_SIZE);
+    TEST_CHECK(window.window() == 4 * PART_SIZE);
+}
+
+static void test_can_start()
+{
+    transfer_window window;
+    window.reset(2 * PART_SIZE, 8 * PART_SIZE, PART_SIZE);
+    TEST_CHECK(window.can_start());
+    window.part_started(0);
+    TEST_CHECK(window.can_start());
+    window.part_started(1);
+    TEST_CHECK(!window.can_start());
+    TEST_CHECK(window.bytes_in_flight() == 2 * PART_SIZE);
+
+    window.part_finished(1);
+    TEST_CHECK(window.bytes_in_flight() == PART_SIZE);
+    // A part that isn't in flight is ignored.
+    window.part_finished(1);
+    window.part_finished(7);
+    TEST_CHECK(window.bytes_in_flight() == PART_SIZE);
+
+    // A single part may always start, even if it's larger than the window.
+    window.reset(PART_SIZE / 2, PART_SIZE / 2, PART_SIZE);
+    window.part_finished(0);
+    TEST_CHECK(window.bytes_in_flight() == 0);
+    TEST_CHECK(window.can_start());
+}
+
+static void test_grows_and_shrinks()
+{
+    transfer_window window;
+    window.reset(PART_SIZE, 16 * PART_SIZE, PART_SIZE);
+    size_t part_id = 0;
+
+    // With a steady round trip time nothing queues up, so the window opens to its maximum.
+    for (int i = 0; i < 8; ++i) {
+        round_trip(window, part_id, 2);
+    }
+    TEST_CHECK(window.window() == 16 * PART_SIZE);
+
+    // Once the round trip time grows well beyond the lowest one seen, the window closes.
+    for (int i = 0; i < 20; ++i) {
+        round_trip(window, part_id, 10);
+    }
+    TEST_CHECK(window.window() < 16 * PART_SIZE);
+    TEST_CHECK(window.window() >= PART_SIZE);
+    TEST_CHECK(window.bytes_in_flight() == 0);
+}
+
+int main()
+{
+    test_reset_limits();
+    test_can_start();
+    test_grows_and_shrinks();
+    return tgl::test::result();
+}